@@ -0,0 +1,376 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file alloc.c - free blocks management for BLDMS service
+ * @brief functions for the allocation of free blocks of the device, based on a bitmap
+ * with one bit per block. The device is split in allocation groups, i.e. ranges of blocks each one with
+ * its own lock, so that operations on blocks of different groups run in parallel. Moreover, each CPU keeps
+ * a small pool of blocks reserved in batches from the bitmap, so that most of the allocations only touch
+ * CPU-local data. Locks are managed inside the functions.
+ * @author Andrea Pepe
+ * @date April 22, 2023  
+*/
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+
+#include "include/alloc.h"
+#include "include/device.h"
+
+/*
+* The bitmap, the groups and the pools of a device are kept in its struct bldms_dev:
+* devices never share any lock of the allocator.
+*/
+
+static inline struct alloc_group *group_of(struct bldms_dev *dev, uint64_t ndx){
+    return &dev->alloc_groups[ndx / dev->group_blocks];
+}
+
+
+/**
+ * @brief  Allocate the bitmap for a device of "nblocks" blocks, with all the blocks initially free,
+ *         and the empty per-CPU pools.
+ */
+int blk_bitmap_init(struct bldms_dev *dev, size_t nblocks){
+    unsigned int i;
+    int cpu;
+
+    dev->blk_bitmap = kvzalloc(BITS_TO_LONGS(nblocks) * sizeof(unsigned long), GFP_KERNEL);
+    if (!dev->blk_bitmap)
+        return -ENOMEM;
+
+    /*
+    * Groups are made of a whole number of bitmap words, so that non-atomic bit operations
+    * on different groups never touch the same word. A device with no data blocks still gets a single,
+    * empty group of one word, so that the size of the groups is never zero.
+    */
+    dev->nr_alloc_groups = min_t(size_t, MAX_ALLOC_GROUPS, DIV_ROUND_UP(nblocks, ALLOC_GROUP_MIN_BLOCKS));
+    if (dev->nr_alloc_groups == 0)
+        dev->nr_alloc_groups = 1;
+    dev->group_blocks = max_t(size_t, round_up(DIV_ROUND_UP(nblocks, dev->nr_alloc_groups), BITS_PER_LONG), BITS_PER_LONG);
+    dev->nr_alloc_groups = DIV_ROUND_UP(nblocks, dev->group_blocks);
+    if (dev->nr_alloc_groups == 0)
+        dev->nr_alloc_groups = 1;
+
+    dev->alloc_groups = kcalloc(dev->nr_alloc_groups, sizeof(struct alloc_group), GFP_KERNEL);
+    if (!dev->alloc_groups)
+        goto err_groups;
+    for (i = 0; i < dev->nr_alloc_groups; i++){
+        spin_lock_init(&dev->alloc_groups[i].lock);
+        dev->alloc_groups[i].first = i * dev->group_blocks;
+        dev->alloc_groups[i].end = min_t(size_t, (i + 1) * dev->group_blocks, nblocks);
+        dev->alloc_groups[i].nr_free = dev->alloc_groups[i].end - dev->alloc_groups[i].first;
+    }
+
+    dev->blk_pools = alloc_percpu(struct blk_pool);
+    if (!dev->blk_pools)
+        goto err_pools;
+    for_each_possible_cpu(cpu){
+        spin_lock_init(&per_cpu_ptr(dev->blk_pools, cpu)->lock);
+    }
+
+    atomic_set(&dev->nr_pooled_blocks, 0);
+    atomic_long_set(&dev->nr_free_blocks, nblocks);
+    return 0;
+
+err_pools:
+    kfree(dev->alloc_groups);
+    dev->alloc_groups = NULL;
+err_groups:
+    kvfree(dev->blk_bitmap);
+    dev->blk_bitmap = NULL;
+    return -ENOMEM;
+}
+
+
+/**
+ * @brief  Mark all the blocks of the device as used, before any of them is known to be free:
+ *         in a lazy mount, the blocks are released one by one as the scan finds them free.
+ *         It must be invoked before the bitmap is used by any writer.
+ */
+void blk_bitmap_fill(struct bldms_dev *dev){
+    unsigned int i;
+
+    bitmap_fill(dev->blk_bitmap, dev->alloc_groups[dev->nr_alloc_groups - 1].end);
+    for (i = 0; i < dev->nr_alloc_groups; i++)
+        dev->alloc_groups[i].nr_free = 0;
+    atomic_long_set(&dev->nr_free_blocks, 0);
+}
+
+
+void blk_bitmap_free(struct bldms_dev *dev){
+    blk_pools_drain(dev);
+    free_percpu(dev->blk_pools);
+    dev->blk_pools = NULL;
+
+    kfree(dev->alloc_groups);
+    dev->alloc_groups = NULL;
+    dev->nr_alloc_groups = 0;
+
+    kvfree(dev->blk_bitmap);
+    dev->blk_bitmap = NULL;
+    atomic_long_set(&dev->nr_free_blocks, 0);
+}
+
+
+/**
+ * @brief  Mark the block of index "ndx" as occupied by a valid message.
+ */
+void mark_block_used(struct bldms_dev *dev, uint64_t ndx){
+    struct alloc_group *grp = group_of(dev, ndx);
+
+    spin_lock(&grp->lock);
+    if (!test_bit(ndx, dev->blk_bitmap)){
+        __set_bit(ndx, dev->blk_bitmap);
+        grp->nr_free--;
+        atomic_long_dec(&dev->nr_free_blocks);
+    }
+    spin_unlock(&grp->lock);
+}
+
+
+/**
+ * @brief  Give the block of index "ndx" back to the free space of the device.
+ *         Only the lock of the group of the block is taken.
+ */
+void release_block(struct bldms_dev *dev, uint64_t ndx){
+    struct alloc_group *grp = group_of(dev, ndx);
+
+    spin_lock(&grp->lock);
+    if (test_bit(ndx, dev->blk_bitmap)){
+        __clear_bit(ndx, dev->blk_bitmap);
+        grp->nr_free++;
+        atomic_long_inc(&dev->nr_free_blocks);
+    }
+    spin_unlock(&grp->lock);
+}
+
+
+/**
+ * @brief  Reserve free blocks of a group, starting from the block "from", and move them in the pool
+ *         until it is full.
+ * @retval The index of the last reserved block, -1 if no block has been reserved.
+ */
+static long group_reserve(struct bldms_dev *dev, struct alloc_group *grp, unsigned long from, struct blk_pool *pool){
+    unsigned long ndx;
+    long last = -1;
+
+    spin_lock(&grp->lock);
+    while (pool->count < BLK_POOL_SIZE && grp->nr_free > 0){
+        ndx = find_next_zero_bit(dev->blk_bitmap, grp->end, from);
+        if (ndx >= grp->end)
+            break;
+
+        __set_bit(ndx, dev->blk_bitmap);
+        grp->nr_free--;
+        atomic_long_dec(&dev->nr_free_blocks);
+        pool->blocks[pool->count++] = ndx;
+        last = ndx;
+        from = ndx + 1;
+    }
+    spin_unlock(&grp->lock);
+    return last;
+}
+
+
+/**
+ * @brief  Reserve up to BLK_POOL_SIZE free blocks of the bitmap and move them in the pool.
+ *         The search is done in a circular buffer manner, starting from the block following the last
+ *         reserved one, one bitmap word at a time, visiting one group at a time. The group the search starts from
+ *         is visited again at the end, from its first block, to wrap around. The lock of the pool must be held by the caller.
+ */
+static void refill_pool(struct bldms_dev *dev, struct blk_pool *pool){
+    unsigned long start;
+    unsigned int g, i;
+    long last;
+
+    pool->next = 0;
+    pool->count = 0;
+
+    start = READ_ONCE(dev->last_written_block) + 1;
+    if (start >= dev->md_array_size)
+        start = 0;
+    g = start / dev->group_blocks;
+
+    for (i = 0; i <= dev->nr_alloc_groups && pool->count < BLK_POOL_SIZE; i++){
+        if (atomic_long_read(&dev->nr_free_blocks) == 0)
+            break;
+        last = group_reserve(dev, &dev->alloc_groups[g], (i == 0) ? start : dev->alloc_groups[g].first, pool);
+        if (last >= 0)
+            WRITE_ONCE(dev->last_written_block, last);
+        g = (g + 1) % dev->nr_alloc_groups;
+    }
+
+    atomic_add(pool->count, &dev->nr_pooled_blocks);
+}
+
+
+/**
+ * @brief  Take a block out of a pool, if any. The lock of the pool must be held by the caller.
+ */
+static inline long pool_take(struct bldms_dev *dev, struct blk_pool *pool){
+    if (pool->next == pool->count)
+        return -ENOMEM;
+
+    atomic_dec(&dev->nr_pooled_blocks);
+    return (long)pool->blocks[pool->next++];
+}
+
+
+/**
+ * @brief  Find a free block and reserve it for a new message. The block is taken from the pool of the
+ *         current CPU, which is refilled in batches from the bitmap when empty; when the bitmap has no free blocks
+ *         left, a block is taken from the pool of another CPU.
+ * @retval The index of the allocated block, -ENOMEM if the device is full.
+ */
+long alloc_free_block(struct bldms_dev *dev){
+    struct blk_pool *pool;
+    long ndx;
+    int cpu;
+
+    // a full device is detected without scanning the bitmap
+    if (atomic_long_read(&dev->nr_free_blocks) == 0 && atomic_read(&dev->nr_pooled_blocks) == 0)
+        return -ENOMEM;
+
+    pool = get_cpu_ptr(dev->blk_pools);
+    spin_lock(&pool->lock);
+    if (pool->next == pool->count)
+        refill_pool(dev, pool);
+    ndx = pool_take(dev, pool);
+    spin_unlock(&pool->lock);
+    put_cpu_ptr(dev->blk_pools);
+
+    if (ndx >= 0)
+        return ndx;
+
+    // under pressure, the free blocks still reserved by the other CPUs are taken back
+    for_each_possible_cpu(cpu){
+        pool = per_cpu_ptr(dev->blk_pools, cpu);
+        spin_lock(&pool->lock);
+        ndx = pool_take(dev, pool);
+        spin_unlock(&pool->lock);
+        if (ndx >= 0)
+            return ndx;
+    }
+
+    return -ENOMEM;
+}
+
+
+/**
+ * @brief  Reserve up to "n" free blocks at once, for the messages of a batch: the pool of the current CPU is locked
+ *         only once, and refilled from the bitmap as many times as needed; the blocks keep the circular allocation
+ *         order. When the bitmap is exhausted, the remaining blocks are taken from the pools of the other CPUs.
+ * @retval The number of blocks reserved in "blocks", less than "n" if the device is full.
+ */
+unsigned int alloc_free_blocks(struct bldms_dev *dev, uint64_t *blocks, unsigned int n){
+    struct blk_pool *pool;
+    unsigned int got = 0;
+    long ndx;
+    int cpu;
+
+    if (atomic_long_read(&dev->nr_free_blocks) == 0 && atomic_read(&dev->nr_pooled_blocks) == 0)
+        return 0;
+
+    pool = get_cpu_ptr(dev->blk_pools);
+    spin_lock(&pool->lock);
+    while (got < n){
+        if (pool->next == pool->count){
+            if (atomic_long_read(&dev->nr_free_blocks) == 0)
+                break;
+            refill_pool(dev, pool);
+        }
+        ndx = pool_take(dev, pool);
+        if (ndx < 0)
+            break;
+        blocks[got++] = ndx;
+    }
+    spin_unlock(&pool->lock);
+    put_cpu_ptr(dev->blk_pools);
+
+    // under pressure, the free blocks still reserved by the other CPUs are taken back
+    for_each_possible_cpu(cpu){
+        if (got == n)
+            break;
+        pool = per_cpu_ptr(dev->blk_pools, cpu);
+        spin_lock(&pool->lock);
+        while (got < n && (ndx = pool_take(dev, pool)) >= 0)
+            blocks[got++] = ndx;
+        spin_unlock(&pool->lock);
+    }
+
+    return got;
+}
+
+
+/**
+ * @brief  Give all the blocks reserved in the per-CPU pools back to the bitmap.
+ */
+void blk_pools_drain(struct bldms_dev *dev){
+    struct blk_pool *pool;
+    long ndx;
+    int cpu;
+
+    if (!dev->blk_pools)
+        return;
+
+    for_each_possible_cpu(cpu){
+        pool = per_cpu_ptr(dev->blk_pools, cpu);
+        spin_lock(&pool->lock);
+        while ((ndx = pool_take(dev, pool)) >= 0){
+            release_block(dev, ndx);
+        }
+        spin_unlock(&pool->lock);
+    }
+}
+
+
+/**
+ * @brief  Print the free space of the device, appending to "buf" from "len": free blocks of the bitmap, blocks reserved
+ *         in the per-CPU pools and number of free extents, i.e. runs of consecutive free blocks, counted group by group
+ *         (the more extents for the same free blocks, the more fragmented the free space); then, the free blocks of
+ *         each allocation group.
+ * @retval The new length of the content of "buf".
+ */
+ssize_t blk_alloc_show(struct bldms_dev *dev, char *buf, ssize_t len){
+    struct alloc_group *grp;
+    unsigned long extents = 0, pos;
+    unsigned int i;
+
+    for (i = 0; i < dev->nr_alloc_groups; i++){
+        grp = &dev->alloc_groups[i];
+        spin_lock(&grp->lock);
+        pos = find_next_zero_bit(dev->blk_bitmap, grp->end, grp->first);
+        while (pos < grp->end){
+            extents++;
+            pos = find_next_bit(dev->blk_bitmap, grp->end, pos);
+            pos = find_next_zero_bit(dev->blk_bitmap, grp->end, pos);
+        }
+        spin_unlock(&grp->lock);
+    }
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, "%d %ld %d %lu", dev->id, atomic_long_read(&dev->nr_free_blocks),
+                    atomic_read(&dev->nr_pooled_blocks), extents);
+    for (i = 0; i < dev->nr_alloc_groups; i++)
+        len += scnprintf(buf + len, PAGE_SIZE - len, " %zu", READ_ONCE(dev->alloc_groups[i].nr_free));
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    return len;
+}
@@ -38,17 +38,28 @@
 #include <linux/string.h>
 #include <linux/blkdev.h>
 #include <linux/vmalloc.h>
+#include <linux/parser.h>
+#include <linux/idr.h>
+#include <linux/percpu-refcount.h>
 
 #include "include/bldms.h"
+#include "include/device.h"
 #include "include/rcu.h"
+#include "include/alloc.h"
 #include "include/syscalls.h"
-
-/* Declaration of global variables for the device management */
-unsigned char bldms_mounted = 0;
-bldms_block **metadata_array;
-size_t md_array_size;
-uint32_t last_written_block = 0;
-struct super_block *the_dev_superblock;
+#include "include/sysfs.h"
+#include "include/cache.h"
+#include "include/durability.h"
+#include "include/checkpoint.h"
+#include "include/scan.h"
+
+/*
+* Registry of the mounted devices, by id: lookups are done inside an RCU read-side critical section, without any lock,
+* and take a reference to the device, so that system calls on different devices never share a cache line.
+* The mutex serializes the mounts and the unmounts.
+*/
+static DEFINE_IDR(bldms_devs);
+static DEFINE_MUTEX(bldms_devs_mutex);
 
 
 static struct super_operations bldms_fs_super_ops = {
@@ -58,16 +69,237 @@ static struct dentry_operations bldms_fs_dentry_ops = {
 };
 
 
+/* Maximum number of blocks of a mountable device: the mount option "max_blocks" overrides it for a single mount */
+static unsigned long max_blocks = NBLOCKS;
+module_param(max_blocks, ulong, 0644);
+MODULE_PARM_DESC(max_blocks, "Maximum number of blocks of a mountable device (0 = no limit)");
+
+
+static void bldms_dev_release(struct percpu_ref *ref){
+    struct bldms_dev *dev = container_of(ref, struct bldms_dev, users);
+
+    complete(&dev->users_done);
+}
+
+
+/**
+ * @brief  Allocate the state of a device that is being mounted, and reserve the lowest free id for it:
+ *         the device can not be found by the system calls until it is published by bldms_dev_publish().
+ * @retval The new device, an error pointer otherwise
+ */
+static struct bldms_dev *bldms_dev_alloc(struct super_block *sb){
+    struct bldms_dev *dev;
+    int id;
+
+    dev = kzalloc(sizeof(struct bldms_dev), GFP_KERNEL);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+    if (percpu_ref_init(&dev->users, bldms_dev_release, 0, GFP_KERNEL)){
+        kfree(dev);
+        return ERR_PTR(-ENOMEM);
+    }
+    init_completion(&dev->users_done);
+    INIT_LIST_HEAD(&dev->durability_node);
+    mutex_init(&dev->commit_mutex);
+    dev->sb = sb;
+    rcu_init(dev);
+    lazy_scan_init(dev);
+
+    mutex_lock(&bldms_devs_mutex);
+    id = idr_alloc(&bldms_devs, NULL, 0, BLDMS_MAX_DEVS, GFP_KERNEL);
+    mutex_unlock(&bldms_devs_mutex);
+    if (id < 0){
+        printk("%s: mounting error - no device id available (error %d)\n", MOD_NAME, id);
+        percpu_ref_exit(&dev->users);
+        kfree(dev);
+        return ERR_PTR((id == -ENOSPC) ? -EBUSY : id);
+    }
+    dev->id = id;
+    return dev;
+}
+
+
+// make a completely mounted device reachable by the system calls
+static void bldms_dev_publish(struct bldms_dev *dev){
+    mutex_lock(&bldms_devs_mutex);
+    dev->mounted = 1;
+    idr_replace(&bldms_devs, dev, dev->id);
+    mutex_unlock(&bldms_devs_mutex);
+}
+
+
+/*
+* Make the device unreachable and wait for the system calls that are still using it:
+* no system call can work on the device after this function returns.
+*/
+static void bldms_dev_unpublish(struct bldms_dev *dev){
+    mutex_lock(&bldms_devs_mutex);
+    idr_remove(&bldms_devs, dev->id);
+    dev->mounted = 0;
+    mutex_unlock(&bldms_devs_mutex);
+
+    percpu_ref_kill(&dev->users);
+    wait_for_completion(&dev->users_done);
+}
+
+
+/**
+ * @brief  Take a reference to the mounted device of id "id", to be released with bldms_dev_put().
+ *         The device can not be unmounted while a reference to it is held.
+ * @retval The device, NULL if no device with such id is mounted
+ */
+struct bldms_dev *bldms_dev_get(int id){
+    struct bldms_dev *dev;
+
+    rcu_read_lock();
+    dev = idr_find(&bldms_devs, id);
+    if (dev && !percpu_ref_tryget_live(&dev->users))
+        dev = NULL;
+    rcu_read_unlock();
+    return dev;
+}
+
+
+void bldms_dev_put(struct bldms_dev *dev){
+    percpu_ref_put(&dev->users);
+}
+
+
+/**
+ * @brief  List the mounted devices, one per line: id, name of the block device and number of blocks.
+ */
+ssize_t bldms_devs_show(char *buf){
+    struct bldms_dev *dev;
+    ssize_t len = 0;
+    int id;
+
+    mutex_lock(&bldms_devs_mutex);
+    idr_for_each_entry(&bldms_devs, dev, id){
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%d %s %lu\n", id, dev->sb->s_id, dev->md_array_size);
+    }
+    mutex_unlock(&bldms_devs_mutex);
+    return len;
+}
+
+
+/**
+ * @brief  Describe the free space of the mounted devices, one per line: id, free blocks, blocks reserved in the
+ *         per-CPU pools, free extents and free blocks of each allocation group (see blk_alloc_show()).
+ */
+ssize_t bldms_devs_free_space_show(char *buf){
+    struct bldms_dev *dev;
+    ssize_t len = 0;
+    int id;
+
+    mutex_lock(&bldms_devs_mutex);
+    idr_for_each_entry(&bldms_devs, dev, id){
+        len = blk_alloc_show(dev, buf, len);
+    }
+    mutex_unlock(&bldms_devs_mutex);
+    return len;
+}
+
+
+/* Mount options */
+enum {
+    Opt_durability,
+    Opt_flush_ms,
+    Opt_lazy,
+    Opt_max_blocks,
+    Opt_err
+};
+
+static const match_table_t bldms_tokens = {
+    {Opt_durability, "durability=%s"},
+    {Opt_flush_ms, "flush_ms=%u"},
+    {Opt_lazy, "lazy"},
+    {Opt_max_blocks, "max_blocks=%s"},
+    {Opt_err, NULL}
+};
+
+
+/**
+ * @brief  Parse the options passed to the mount: "durability=sync|async|group|periodic", "flush_ms=N",
+ *         the period of the flushes in periodic mode, "lazy", to build the index in background, and "max_blocks=N",
+ *         the maximum number of blocks of the device (0 for no limit).
+ *         The durability mode and the period are shared by all the devices: they are -1 and 0 if not specified,
+ *         while the other options that are not specified get their default value.
+ * @retval 0 if all the options are valid, -EINVAL otherwise
+ */
+static int parse_mount_options(char *options, int *mode, unsigned int *flush_ms, int *lazy, u64 *limit){
+    substring_t args[MAX_OPT_ARGS];
+    char *p, *name;
+    int token, val;
+
+    *mode = -1;
+    *flush_ms = 0;
+    *lazy = 0;
+    *limit = READ_ONCE(max_blocks);
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL){
+        if (!*p)
+            continue;
+
+        token = match_token(p, bldms_tokens, args);
+        switch (token){
+            case Opt_durability:
+                name = match_strdup(&args[0]);
+                if (!name)
+                    return -ENOMEM;
+                *mode = durability_mode_from_name(name);
+                kfree(name);
+                if (*mode < 0){
+                    printk("%s: unknown durability mode in option \"%s\"\n", MOD_NAME, p);
+                    return -EINVAL;
+                }
+                break;
+            case Opt_flush_ms:
+                if (match_int(&args[0], &val) || val <= 0){
+                    printk("%s: invalid option \"%s\"\n", MOD_NAME, p);
+                    return -EINVAL;
+                }
+                *flush_ms = val;
+                break;
+            case Opt_lazy:
+                *lazy = 1;
+                break;
+            case Opt_max_blocks:
+                if (match_u64(&args[0], limit)){
+                    printk("%s: invalid option \"%s\"\n", MOD_NAME, p);
+                    return -EINVAL;
+                }
+                break;
+            default:
+                printk("%s: unknown mount option \"%s\"\n", MOD_NAME, p);
+                return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+
 int bldms_fs_fill_super(struct super_block *sb, void *data, int silent){
 
     struct inode *root_inode;
     struct bldms_inode *the_file_inode;
     struct buffer_head *bh;
     struct bldms_sb_info *sb_info;
-    uint64_t magic;
+    struct bldms_dev *dev;
+    uint64_t magic, version, sb_md_table_blocks, sb_ckpt_blocks, clean;
     struct timespec64 curr_time;
-    int i, ret;
-    rcu_elem *rcu_el;
+    int ret, durability, lazy;
+    unsigned int flush_ms;
+    rcu_elem *rcu_el, *tmp_el;
+    struct valid_desc *valid = NULL;
+    uint64_t ndx, nr_blocks;
+    u64 limit;
+    size_t j, nr_valid;
+
+    ret = parse_mount_options((char *)data, &durability, &flush_ms, &lazy, &limit);
+    if (ret)
+        return ret;
 
     // assign the magic number that identifies the FS
     sb->s_magic = MAGIC;
@@ -78,9 +310,13 @@ int bldms_fs_fill_super(struct super_block *sb, void *data, int silent){
         return -EIO;
     }
 
-    // read the magic number from the device
+    // read the magic number and the format version from the device
     sb_info = (struct bldms_sb_info *) bh->b_data;
     magic = sb_info->magic;
+    version = sb_info->version;
+    sb_md_table_blocks = sb_info->md_table_blocks;
+    sb_ckpt_blocks = sb_info->ckpt_blocks;
+    clean = sb_info->clean;
     brelse(bh);
 
     // check if the magic number corresponds to the expected one
@@ -88,10 +324,25 @@ int bldms_fs_fill_super(struct super_block *sb, void *data, int silent){
         return -EBADF;
     }
 
-    // set file-system specific info and operations
-    sb->s_fs_info = NULL;
+    if (version != BLDMS_FORMAT_V1 && version != BLDMS_FORMAT_V2 && version != BLDMS_FORMAT_V3){
+        printk("%s: mounting error - unsupported format version %llu\n", MOD_NAME, version);
+        return -EINVAL;
+    }
+
+    // set file-system specific info and operations: the state of the device is freed by kill_sb, also if the mount fails
+    dev = bldms_dev_alloc(sb);
+    if (IS_ERR(dev)){
+        return PTR_ERR(dev);
+    }
+    sb->s_fs_info = dev;
     sb->s_op = &bldms_fs_super_ops;
 
+    // a mount whose durability options conflict with the ones of the mounted devices fails before reading the device
+    ret = durability_start(dev, durability, flush_ms);
+    if (ret < 0){
+        return ret;
+    }
+
     root_inode = iget_locked(sb, 0);
     if (!root_inode){
         return -ENOMEM;
@@ -145,173 +396,231 @@ int bldms_fs_fill_super(struct super_block *sb, void *data, int silent){
     * so such check is performed here. 
     * */
     the_file_inode = (struct bldms_inode *) bh->b_data;
-    
-    if (the_file_inode->file_size > NBLOCKS * DEFAULT_BLOCK_SIZE){
+    nr_blocks = the_file_inode->file_size / DEFAULT_BLOCK_SIZE;
+    brelse(bh);
+
+    if (limit && nr_blocks > limit){
         // unamangeable block: too big
-        printk("%s: mounting error - the device has %llu blocks, while NBLOCKS is %d\n", MOD_NAME, the_file_inode->file_size / DEFAULT_BLOCK_SIZE, NBLOCKS);
+        printk("%s: mounting error - the device has %llu blocks, while the limit is %llu\n", MOD_NAME, nr_blocks, limit);
+        return -E2BIG;
+    }
+    if (nr_blocks > SIZE_MAX){
+        printk("%s: mounting error - the device has %llu blocks, too many for this architecture\n", MOD_NAME, nr_blocks);
         return -E2BIG;
     }
-    
-    // compute the number of blocks of the device and init an array of blocks metadata
-    md_array_size = the_file_inode->file_size / DEFAULT_BLOCK_SIZE;
-    brelse(bh);
 
-    AUDIT
-        printk("%s: the device has %lu blocks\n", MOD_NAME, md_array_size);
+    // compute the number of blocks of the device
+    dev->md_array_size = nr_blocks;
 
-    // this is a temp array used to order blocks by ascending timestamp, in order to place them in order in the RCU list
-    if(sizeof(bldms_block *) * md_array_size > 1024 * PAGE_SIZE){
-        // kzalloc can only allocate up to 4MB; if bigger, use vzalloc
-        metadata_array = vzalloc(sizeof(bldms_block *) * md_array_size);
-        if(!metadata_array){
+    // the metadata table, from format version 2 on, must be big enough for all the blocks of the device
+    dev->bldms_format = version;
+    dev->md_table_blocks = 0;
+    if (has_md_table(dev)){
+        if (sb_md_table_blocks != MD_TABLE_BLOCKS(dev->md_array_size)){
+            printk("%s: mounting error - metadata table of %llu blocks, %lu expected\n", MOD_NAME,
+                    sb_md_table_blocks, MD_TABLE_BLOCKS(dev->md_array_size));
             return -EINVAL;
         }
-    }else{
-        metadata_array = kzalloc(sizeof(bldms_block *) * md_array_size, GFP_ATOMIC);
-        if(!metadata_array){
+        dev->md_table_blocks = sb_md_table_blocks;
+    }
+    /*
+    * The checkpoint region is optional, and the fields are meaningless in version 1; its size depends on the size
+    * of the records, that is different in version 2 and 3, and it determines where the data blocks start.
+    */
+    dev->ckpt_blocks = 0;
+    if (has_md_table(dev) && sb_ckpt_blocks){
+        if (sb_ckpt_blocks != CKPT_BLOCKS(dev->md_array_size, dev->bldms_format)){
+            printk("%s: mounting error - checkpoint region of %llu blocks, %lu expected\n", MOD_NAME,
+                    sb_ckpt_blocks, CKPT_BLOCKS(dev->md_array_size, dev->bldms_format));
             return -EINVAL;
         }
+        dev->ckpt_blocks = sb_ckpt_blocks;
     }
+    if (!dev->ckpt_blocks)
+        clean = 0;
+    printk("%s: mounting a device with format version %u\n", MOD_NAME, dev->bldms_format);
+
+    /*
+    * The memory taken by the in-memory structures is predictable: a fixed part, proportional to the number of blocks
+    * of the device (one bit of the free-space bitmap per block, one pointer of the index directory per 512 blocks),
+    * and a part proportional to the number of valid blocks only (one element of the RCU list, and at most one slot
+    * of a page of the index, per valid block). No per-block array of headers is kept in memory.
+    */
+    printk("%s: the device has %lu blocks - %lu bytes of fixed memory, up to %lu bytes per valid block\n", MOD_NAME,
+            dev->md_array_size, BITS_TO_LONGS(dev->md_array_size) * sizeof(unsigned long) +
+            DIV_ROUND_UP(dev->md_array_size, INDEX_PAGE_ENTRIES) * sizeof(void *),
+            sizeof(rcu_elem) + sizeof(void *));
 
     /*
     * Initialize data structures and RCU-list for device's block mapping and management:
-    * an array of metadata for each block of the device is maintained, while in the RCU list
+    * a bitmap of the free blocks and an index of the valid blocks are maintained, while in the RCU list
     * will be placed only the actually valid blocks, i.e. containing valid messages.
     * The RCU list is kept ordered timestamp-wise.
     */
-    rcu_init();
-    for (i = 0; i < md_array_size; i++){
-        bh = sb_bread(sb, i + NUM_METADATA_BLKS);
-        metadata_array[i] = kzalloc(sizeof(bldms_block), GFP_ATOMIC);
-        if (!metadata_array[i]){
-            i--;
-            ret = -ENOMEM;
+    ret = valid_blk_index_init(dev, dev->md_array_size);
+    if (ret == 0)
+        ret = blk_bitmap_init(dev, dev->md_array_size);
+    if (ret < 0){
+        goto err_and_clean_rcu;
+    }
+
+    /*
+    * After a clean unmount, the valid blocks are read from the checkpoint; otherwise, or if the checkpoint is
+    * not valid, the headers of all the blocks are read: in version 2 only the metadata table is read.
+    * In a lazy mount, the headers are read in background, once the device is mounted.
+    */
+    ret = -ENOENT;
+    if (clean){
+        ret = load_checkpoint(dev, &valid, &nr_valid);
+        if (ret < 0)
+            printk("%s: unable to use the checkpoint (error %d) - scanning the whole device\n", MOD_NAME, ret);
+    }
+    if (ret < 0 && lazy){
+        // all the blocks are used until the scan finds them free
+        blk_bitmap_fill(dev);
+        nr_valid = 0;
+        ret = 0;
+    }else if (ret < 0){
+        lazy = 0;
+        ret = load_metadata(dev, &valid, &nr_valid);
+    }else{
+        lazy = 0;
+    }
+    if (ret < 0){
+        // when error, free the allocated data structure before returning
+        goto err_and_clean_rcu;
+    }
+
+    // the checkpoint becomes stale with the first write: the flag is cleared before the device can be modified
+    if (clean){
+        ret = set_clean_flag(dev, 0);
+        if (ret < 0)
             goto err_and_clean_rcu;
-        }
-        if (!bh){
-            // when error, free the allocated data structure before returning
-            ret = -EIO;
+    }
+
+    /*
+    * Initialize the RCU list of valid blocks with the blocks already present and valid found on the device.
+    * They are already sorted in (timestamp, index) order, so each of them is appended to the tail of the list,
+    * in O(1), and the whole index is built in linear time after the O(n log n) sort.
+    */
+    for (j = 0; j < nr_valid; j++){
+        ndx = valid[j].ndx;
+        AUDIT
+            pr_info("%s: Block of index %llu is valid - it has timestamp %lld, valid bytes %u and is_valid %d\n", MOD_NAME, ndx,
+                valid[j].md.nsec, valid[j].md.valid_bytes, valid[j].md.is_valid);
+
+        rcu_el = rcu_elem_alloc(GFP_KERNEL);
+        if(!rcu_el || valid_blk_index_prepare(dev, ndx) < 0){
+            if (rcu_el)
+                rcu_elem_free(rcu_el);
+            ret = -ENOMEM;
             goto err_and_clean_rcu;
-        }       
-        memcpy(metadata_array[i], bh->b_data, sizeof(bldms_block));
-        brelse(bh);
-
-        // if it's a valid block, also insert it into the initial RCU list
-        if (metadata_array[i]->is_valid == BLK_VALID){
-            AUDIT
-                pr_info("%s: Block of index %u is valid - it has timestamp %lld, valid bytes %u and is_valid %d\n", MOD_NAME, i,
-                    metadata_array[i]->nsec, metadata_array[i]->valid_bytes, metadata_array[i]->is_valid);
-                    
-            rcu_el = kzalloc(sizeof(rcu_elem), GFP_ATOMIC);
-            if(!rcu_el){
-                ret = -ENOMEM;
-                goto err_and_clean_rcu;
-            }
-            /*
-            * Initialize the RCU list of valid blocks, by pushing in order the blocks
-            * already present and valid found on the device.
-            * The RCU list will always be kept in timestamp order. 
-            */
-            add_valid_block_in_order_secure(rcu_el, i, metadata_array[i]->valid_bytes, metadata_array[i]->nsec);
         }
+        add_valid_block_secure(dev, rcu_el, ndx, valid[j].md.valid_bytes, valid[j].md.nsec);
+        mark_block_used(dev, ndx);
     }
+    kvfree(valid);
+    valid = NULL;
 
     
     // the number of the last valid block is saved to be used as a reference for finding the next free block to be written
-    last_written_block = (!list_empty(&valid_blk_list)) ? (list_last_entry(&valid_blk_list, rcu_elem, node)->ndx) : (md_array_size - 1);
+    dev->last_written_block = (!list_empty(&dev->valid_blk_list)) ? (list_last_entry(&dev->valid_blk_list, rcu_elem, node)->ndx) : (dev->md_array_size - 1);
+    // new messages will get timestamps bigger than all the ones already on the device
+    dev->last_timestamp = (!list_empty(&dev->valid_blk_list)) ? (list_last_entry(&dev->valid_blk_list, rcu_elem, node)->nsec) : 0;
+
+    if (lazy){
+        ret = lazy_scan_start(dev);
+        if (ret < 0)
+            goto err_and_clean_rcu;
+    }
 
-    // signal that the device (with the file system) has been mounted
-    bldms_mounted = 1;
+    // signal that the device (with the file system) has been mounted: from now on, system calls can use it
+    bldms_dev_publish(dev);
+    printk("%s: device %s mounted with id %d\n", MOD_NAME, sb->s_id, dev->id);
 
     return 0;
 
 err_and_clean_rcu:
+    kvfree(valid);
     // no need to be RCU-safe here, since no one can actually access the list in initialization phase
-    list_for_each_entry(rcu_el, &valid_blk_list, node){
+    list_for_each_entry_safe(rcu_el, tmp_el, &dev->valid_blk_list, node){
         list_del(&(rcu_el->node));
-        kfree(rcu_el);
-    }
-
-    for(; i >= 0; i--){
-        kfree(metadata_array[i]);
+        rcu_elem_free(rcu_el);
     }
+    dev->valid_blk_tree = RB_ROOT;
 
-    if(sizeof(bldms_block *) * md_array_size > 1024 * PAGE_SIZE){
-        vfree(metadata_array);
-    }else{
-        kfree(metadata_array);
-    }
+    valid_blk_index_free(dev);
+    blk_bitmap_free(dev);
 
     return ret;
 }
 
 
-static inline void free_data_structures(void){
-    // take the spinlock and release it only when all rcu elements are safely deleted from the list   
-    spin_lock(&rcu_write_lock); 
+static inline void free_data_structures(struct bldms_dev *dev){
+    /*
+    * The RCU list is detached in one step and reclaimed after a single grace period; after that, no reader can
+    * reference the per-block index anymore, so the remaining structures are freed in bulk, without any lock held.
+    */
+    remove_all_entries(dev);
+    valid_blk_index_free(dev);
+    blk_bitmap_free(dev);
+}
+
 
-    remove_all_entries_secure();
-    
+static void bldms_fs_kill_sb(struct super_block *sb){
+    struct bldms_dev *dev = BLDMS_DEV(sb);
+    int complete, mounted, ret;
 
-    if(sizeof(bldms_block *) * md_array_size > 1024 * PAGE_SIZE){
-        vfree(metadata_array);
-    }else{
-        kfree(metadata_array);
+    // the mount failed before the state of the device was allocated
+    if (!dev){
+        kill_block_super(sb);
+        return;
     }
 
-    metadata_array = NULL;
-    md_array_size = 0;
-    the_dev_superblock = NULL;
-    bldms_mounted = 0;
-    spin_unlock(&rcu_write_lock);   
-}
+    // new system calls on the device fail with ENODEV from now on, and the ones in progress are waited for
+    mounted = dev->mounted;
+    bldms_dev_unpublish(dev);
 
+    // the background scan of a lazy mount is stopped: if it did not complete, the index can not be saved
+    complete = lazy_scan_stop(dev);
 
-static void bldms_fs_kill_sb(struct super_block *sb){
+    // a last flush is done in periodic mode, then the device is no more flushed
+    durability_stop(dev);
+
+    /*
+    * The index is saved in the checkpoint region, then the clean flag is set only once the checkpoint and all the
+    * blocks written on the device are durable. No system call can use the device anymore, so the checkpoint is
+    * the final state.
+    */
+    if (dev->ckpt_blocks && mounted && complete){
+        ret = write_checkpoint(dev);
+        if (ret == 0)
+            ret = flush_whole_device(sb->s_bdev);
+        if (ret == 0)
+            ret = set_clean_flag(dev, 1);
+        if (ret < 0)
+            printk("%s: unable to save the checkpoint of device %d (error %d) - the next mount scans it\n", MOD_NAME,
+                    dev->id, ret);
+    }
     kill_block_super(sb);
-    
-    if(the_dev_superblock)
-        blkdev_put(the_dev_superblock->s_bdev, FMODE_READ | FMODE_WRITE);
 
-    free_data_structures();
-    
-    printk(KERN_INFO "%s: file system successfully unmounted\n", MOD_NAME);
+    free_data_structures(dev);
+    percpu_ref_exit(&dev->users);
+    printk(KERN_INFO "%s: device %d successfully unmounted\n", MOD_NAME, dev->id);
+    // lookups that found the device in the registry may still be checking its reference
+    kfree_rcu(dev, rcu);
     return;
 }
 
 
-// Called on mount operations
+// Called on mount operations: each block device is a different file system, with its own id
 struct dentry *bldms_fs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, void *data){
     struct dentry *ret;
-    struct block_device *the_device;
-    if (bldms_mounted){
-        printk("%s: the device is already mounted and it supports only 1 single mount at a time\n", MOD_NAME);
-        return ERR_PTR(-EBUSY);
-    }
 
-        
     // pass custom callback function to fill the superblock
     ret = mount_bdev(fs_type, flags, dev_name, data, bldms_fs_fill_super);
     if (unlikely(IS_ERR(ret)))
         printk("%s: error mounting the file system\n", MOD_NAME);
-    else{
-        // try to save a reference to the superblock of the device, in order to allow system calls to use it
-        the_device = blkdev_get_by_path(dev_name, FMODE_READ | FMODE_WRITE, NULL);
-        if(IS_ERR(the_device)){
-            free_data_structures();
-            printk("%s: error getting a reference to the device\n", MOD_NAME);
-            return ERR_PTR(-EINVAL);
-        }
-        the_dev_superblock = the_device->bd_super;
-
-        if(the_dev_superblock && the_dev_superblock->s_bdev)
-            printk("%s: got superblock reference - it has magic number 0x%lx", MOD_NAME, the_dev_superblock->s_magic);
-        else{
-            printk("%s: unable to get a reference to the device superblock\n", MOD_NAME);
-            free_data_structures();
-            return ERR_PTR(-EINVAL);
-        }
-    }
 
     return ret;
 }
@@ -334,12 +643,31 @@ static int __init bldms_init(void){
         return ret;
     }
 
+    ret = bldms_caches_init();
+    if(unlikely(ret < 0)){
+        printk("%s: unable to create the slab caches - error %d\n", MOD_NAME, ret);
+        unregister_syscalls();
+        return ret;
+    }
+
+    ret = bldms_sysfs_init();
+    if(unlikely(ret < 0)){
+        printk("%s: unable to create the sysfs directory - error %d\n", MOD_NAME, ret);
+        bldms_caches_destroy();
+        unregister_syscalls();
+        return ret;
+    }
+
     // register the filesystem type
     ret = register_filesystem(&bldms_fs_type);
-    if (likely(ret == 0))
+    if (likely(ret == 0)){
         printk("%s: successfully registered %s\n", MOD_NAME, bldms_fs_type.name);
-    else
+    }else{
         printk("%s: failed to register %s - error %d\n", MOD_NAME, bldms_fs_type.name, ret);
+        bldms_sysfs_exit();
+        bldms_caches_destroy();
+        unregister_syscalls();
+    }
 
     return ret;
 }
@@ -357,6 +685,14 @@ static void __exit bldms_exit(void){
         printk("%s: sucessfully unregistered %s driver\n",MOD_NAME, bldms_fs_type.name);
     else
         printk("%s: failed to unregister %s driver - error %d", MOD_NAME, bldms_fs_type.name, ret);
+
+    bldms_sysfs_exit();
+
+    idr_destroy(&bldms_devs);
+
+    // wait for the pending RCU callbacks, whose code is part of the module
+    rcu_barrier();
+    bldms_caches_destroy();
 }
 
 
@@ -17,7 +17,8 @@
  * @file bldmsmakefs.c - file system formatter for the Block-Level Data Management System (BLDMS)
  * @brief file system formatter for the Block-Level Data Management System (BLDMS).
  *        If compiled with the FILL_DEV directive, the device is initially formatted with some valid messages
- *        pre-installed.
+ *        pre-installed. The device is formatted with the format version 3 (headers packed in a metadata table,
+ *        64-bit indexes in the checkpoint region), unless the FORMAT_V1 or FORMAT_V2 directive is set.
  * @author Andrea Pepe
  * @date April 22, 2023  
 */
@@ -38,7 +39,9 @@
  * information onto the disk:
  *  - BLOCK 0, superblock;
  *  - BLOCK 1, inode of the unique file (the inode for root is volatile)
- *  - BLOCK 2, ..., N, inodes and datablocks for th messages.
+ *  - BLOCK 2, ..., T+1, metadata table, with the headers of all the data blocks (format version 2 and 3 only)
+ *  - BLOCK T+2, ..., T+C+1, checkpoint region, written by the module at a clean unmount (format version 2 and 3 only)
+ *  - BLOCK T+C+2, ..., N, datablocks for the messages.
 */
 
 #define BILLION 1000000000L
@@ -50,18 +53,82 @@ typedef struct __attribute__((packed)) _blk{
 } blk;
 
 #define BLK_MD_SIZE sizeof(blk)
+#define MD_ENTRIES_PER_BLOCK (DEFAULT_BLOCK_SIZE / BLK_MD_SIZE)
+#define TABLE_BLOCKS(n) (((n) + MD_ENTRIES_PER_BLOCK - 1) / MD_ENTRIES_PER_BLOCK)
+
+#ifdef FORMAT_V1
+    #define FORMAT_VERSION BLDMS_FORMAT_V1
+#elif defined(FORMAT_V2)
+    #define FORMAT_VERSION BLDMS_FORMAT_V2
+#else
+    #define FORMAT_VERSION BLDMS_FORMAT_V3
+#endif
+
+// checkpoint: a 16 bytes header, followed by a record for each valid block, of 14 bytes in version 2, 18 bytes in version 3
+#define CKPT_RECORD_SIZE ((FORMAT_VERSION == BLDMS_FORMAT_V2) ? 14 : 18)
+#define CKPT_BLOCKS(n) ((16 + (n) * CKPT_RECORD_SIZE + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE)
+
+
+/*
+* Returns the message pre-installed in the data block of index "i", if any, and fills its header;
+* NULL if the block is initially invalid. It is called once for the metadata table and once for the data blocks,
+* so the timestamps are computed from a time taken only at the first call, to give the same header both times.
+*/
+char *initial_message(uint64_t i, blk *header){
+    char *s = NULL;
+#ifdef FILL_DEV
+    static signed long long base_nsec = 0;
+    struct timespec ts;
+    signed long long nsec;
+
+    switch(i){
+        case 0:
+            s = "This is the message present at the first block, but with a timestamp of 100 seconds greater than the original\n"; break;
+        case 5:
+            s = "Hello, I am a message present in block number 5!\n"; break;
+        case 9:
+            s = "This is message for block 9, with timestamp of 9 seconds greater than it should be :)\n"; break;
+        case 17:
+            s = "Hi there, this is message from block number 17 and my timestamp has been increased exactly of 17 seconds ;)\n"; break;
+        case 22:
+            s = "I'm just a normal message put in block 22, but at least by block number is palindrome :)\n"; break;
+    }
+    if (s){
+        if (!base_nsec){
+            clock_gettime(CLOCK_REALTIME, &ts);
+            // tv_nsec are the expired nsec in the second specified by tv_sec: bring all to nsec count
+            base_nsec = ts.tv_sec*BILLION + ts.tv_nsec;
+        }
+        nsec = base_nsec + i;                       // distinct timestamps, in index order
+        if (i == 9 || i== 17){
+            nsec += i*BILLION;                      // add seconds equal to the block number to make timestamp order differ from index order
+        }else if (i == 0){
+            nsec += 100*BILLION;                    // add 100 seconds to the block in the first position on the device, in order to give it the biggest timestamp
+        }
+        header->nsec = nsec;
+        header->is_valid = BLK_VALID;
+        header->valid_bytes = strlen(s) + 1;        //take into account also the string terminator character
+        return s;
+    }
+#endif
+    header->nsec = 0;
+    header->is_valid = BLK_INVALID;
+    header->valid_bytes = 0;
+    return s;
+}
+
 
 int main(int argc, char **argv){
     int fd, nbytes;
     ssize_t ret;
     struct bldms_sb_info sb_info;
     struct bldms_inode file_inode;
-    struct bldms_dir_record dir_record;
-    char *block_padding;
+    char *block_padding, *block, *msg;
+    blk header;
     struct stat st;
     off_t size;
-    uint num_data_blocks;
-    uint32_t i;
+    uint64_t num_blocks, num_data_blocks, table_blocks = 0, ckpt_blocks = 0;
+    uint64_t i, j, nr_entries;
 
     if (argc != 2){
         printf("Usage: %s <image>\n", argv[0]);
@@ -78,9 +145,37 @@ int main(int argc, char **argv){
     fstat(fd, &st);
     size = st.st_size;
 
+    /*
+    * All the blocks but the superblock and the inode are used for data blocks and, from format version 2 on,
+    * for the metadata table and the checkpoint region: as many data blocks as possible are kept, with 409 headers
+    * per table block and enough checkpoint blocks to save the index when all the data blocks are valid.
+    */
+    num_blocks = size / DEFAULT_BLOCK_SIZE;
+    if (num_blocks <= 2){
+        printf("The image is too small to be formatted.\n");
+        close(fd);
+        return -1;
+    }
+    num_data_blocks = num_blocks - 2;
+#if FORMAT_VERSION != BLDMS_FORMAT_V1
+    while (num_data_blocks + TABLE_BLOCKS(num_data_blocks) + CKPT_BLOCKS(num_data_blocks) > num_blocks - 2)
+        num_data_blocks--;
+    table_blocks = TABLE_BLOCKS(num_data_blocks);
+    ckpt_blocks = CKPT_BLOCKS(num_data_blocks);
+#endif
+    if (num_data_blocks == 0){
+        printf("The image is too small to keep any data block.\n");
+        close(fd);
+        return -1;
+    }
+
     // pack the superblock
-    sb_info.version = 1;
+    memset(&sb_info, 0, sizeof(sb_info));
+    sb_info.version = FORMAT_VERSION;
     sb_info.magic = MAGIC;
+    sb_info.md_table_blocks = table_blocks;
+    sb_info.ckpt_blocks = ckpt_blocks;
+    sb_info.clean = 0;                      // no checkpoint yet: the first mount reads the metadata table
 
     // write on the device
     ret = write(fd, (char *)&sb_info, sizeof(sb_info));
@@ -91,13 +186,14 @@ int main(int argc, char **argv){
         return ret;
     }
 
-    printf("Superblock written successfully\n");
+    printf("Superblock written successfully (format version %d)\n", FORMAT_VERSION);
 
     // write single file inode
+    memset(&file_inode, 0, sizeof(file_inode));
     file_inode.mode = S_IFREG;
     file_inode.inode_no = BLDMS_SINGLEFILE_INODE_NUMBER;
-    // device size is the size of the image file minus the size of the superblock and of the device file inode block
-    file_inode.file_size = size - (2 * DEFAULT_BLOCK_SIZE);
+    // device size is the size of the data blocks, i.e. of the image file minus the superblock, the inode block, the metadata table and the checkpoint
+    file_inode.file_size = num_data_blocks * DEFAULT_BLOCK_SIZE;
     printf("Detected file size is: %ld\n", file_inode.file_size);
 
     // write the inode of the device (i.e. of the single file)
@@ -112,115 +208,78 @@ int main(int argc, char **argv){
 
     // padding for the block containing the file inode
     nbytes = DEFAULT_BLOCK_SIZE - ret;
-    block_padding = malloc(nbytes);
+    block_padding = calloc(nbytes, 1);
     ret = write(fd, block_padding, nbytes);
     if (ret != nbytes){
         printf("Padding for file inode block was not properly written.\n");
         close(fd);
         return -1;
     }
+    free(block_padding);
     printf("Padding for the block containing the file inode succesfully written.\n");
 
 
-    // all other blocks are reserved for user datablocks but the metadata needs to be written
-
     /*
     * Initialize metadata of each block of the block device:
     * - nsec: 8 bytes timestamp value, initialized to zero
     * - is_valid: 1 bit, initialized to 0 (not valid) for each invalid block, to 1 for the valid ones
     * - valid_bytes: 15 bits, initialized to 0 for invalid blocks
+    * Each block of the table and each data block is built when it is written, so the memory needed does not
+    * depend on the size of the device.
     * */
-    num_data_blocks = file_inode.file_size / DEFAULT_BLOCK_SIZE;
-    blk my_blk = {
-        .nsec = 0,
-        .is_valid = BLK_INVALID,
-        .valid_bytes = 0
-    };
-
-    nbytes = DEFAULT_BLOCK_SIZE - BLK_MD_SIZE;
-    // initialized to zero, also used for zero values other than padding
-    block_padding = calloc(nbytes, 1);
-    char *string0 = "This is the message present at the first block, but with a timestamp of 100 seconds greater than the original\n";
-    char *string5 = "Hello, I am a message present in block number 5!\n";
-    char *string9 = "This is message for block 9, with timestamp of 9 seconds greater than it should be :)\n";
-    char *string17 = "Hi there, this is message from block number 17 and my timestamp has been increased exactly of 17 seconds ;)\n";
-    char *string22 = "I'm just a normal message put in block 22, but at least by block number is palindrome :)\n";
-    for (i=0; i<num_data_blocks; i++){
-#ifdef FILL_DEV
-        if (i==0 || i==5 || i==9 || i==17 || i==22){
-            char *s;
-            switch(i){
-                case 0:
-                    s = string0; break;
-                case 5:
-                    s = string5; break;
-                case 9:
-                    s = string9; break;
-                case 17:
-                    s = string17; break;
-                case 22:
-                    s = string22; break;
-            }
-
-            uint16_t valid_bytes = strlen(s) + 1;       //take into account also the string terminator character
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            
-            // tv_nsec are the expired nsec in the second specified by tv_sec: bring all to nsec count
-            signed long long nsec = ts.tv_sec*BILLION + ts.tv_nsec;
-            if (i == 9 || i== 17){
-                nsec += i*BILLION;                      // add seconds equal to the block number to make timestamp order differ from index order
-            }else if (i == 0){
-                nsec += 100*BILLION;                    // add 100 seconds to the block in the first position on the device, in order to give it the biggest timestamp
-            }
-
-            my_blk.nsec = nsec;
-            my_blk.is_valid = BLK_VALID;
-            my_blk.valid_bytes = valid_bytes;
-            ret = write(fd, &my_blk, BLK_MD_SIZE);
-            if(ret != BLK_MD_SIZE){
-                printf("Error initializing device block content: ret is %ld, should have been %d\n", ret, nbytes - valid_bytes);
-                close(fd);
-                return -1;
-            }
-
-            ret = write(fd, s, my_blk.valid_bytes);
-            if(ret != my_blk.valid_bytes){
-                printf("Error initializing device block content: ret is %ld, should have been %d\n", ret, nbytes - valid_bytes);
-                close(fd);
-                return -1;
-            }
-
-            ret = write(fd, block_padding, nbytes - my_blk.valid_bytes);
-            if(ret != nbytes - my_blk.valid_bytes){
-                printf("Error initializing device block padding: ret is %ld, should have been %d\n", ret, nbytes - valid_bytes);
-                close(fd);
-                return -1;
-            }
-
-            continue;
+    block = malloc(DEFAULT_BLOCK_SIZE);
+    if (!block){
+        printf("Unable to allocate memory for the blocks\n");
+        close(fd);
+        return -1;
+    }
+
+    // format version 2 and 3: the metadata table, 409 headers per block, the rest of each block is zeroed
+    for (i=0; i<table_blocks; i++){
+        memset(block, 0, DEFAULT_BLOCK_SIZE);
+        nr_entries = (num_data_blocks - i * MD_ENTRIES_PER_BLOCK < MD_ENTRIES_PER_BLOCK) ? num_data_blocks - i * MD_ENTRIES_PER_BLOCK : MD_ENTRIES_PER_BLOCK;
+        for (j=0; j<nr_entries; j++){
+            initial_message(i * MD_ENTRIES_PER_BLOCK + j, &header);
+            memcpy(block + j * BLK_MD_SIZE, &header, BLK_MD_SIZE);
         }
-#endif
-        my_blk.nsec = 0;
-        my_blk.is_valid = BLK_INVALID;
-        my_blk.valid_bytes = 0;
-        ret = write(fd, &my_blk, BLK_MD_SIZE);
-        if (ret != BLK_MD_SIZE){
-            printf("Error writing device block's metadata (fields set to 0)\n");
+        ret = write(fd, block, DEFAULT_BLOCK_SIZE);
+        if (ret != DEFAULT_BLOCK_SIZE){
+            printf("Error writing the metadata table\n");
             close(fd);
             return -1;
         }
+    }
+
+    // format version 2 and 3: the checkpoint region, zeroed
+    memset(block, 0, DEFAULT_BLOCK_SIZE);
+    for (i=0; i<ckpt_blocks; i++){
+        ret = write(fd, block, DEFAULT_BLOCK_SIZE);
+        if (ret != DEFAULT_BLOCK_SIZE){
+            printf("Error writing the checkpoint region\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    // data blocks: each one starts with the header of the block, followed by the message, if any, and zeroes
+    for (i=0; i<num_data_blocks; i++){
+        memset(block, 0, DEFAULT_BLOCK_SIZE);
+        msg = initial_message(i, &header);
+        memcpy(block, &header, BLK_MD_SIZE);
+        if (msg)
+            memcpy(block + BLK_MD_SIZE, msg, header.valid_bytes);
 
-        // write block data: it is initialized to 0
-        ret = write(fd, block_padding, nbytes);
-        if(ret != nbytes){
+        ret = write(fd, block, DEFAULT_BLOCK_SIZE);
+        if (ret != DEFAULT_BLOCK_SIZE){
             printf("Error initializing device block content\n");
             close(fd);
             return -1;
         }
     }
 
-    printf("File system formatted correctly\n");
+    free(block);
+    printf("File system formatted correctly: %lu data blocks, %lu blocks of metadata table, %lu blocks of checkpoint\n",
+            num_data_blocks, table_blocks, ckpt_blocks);
     close(fd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,176 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file cache.c
+ * @brief dedicated slab caches for the small objects allocated on the hot paths of the service,
+ * i.e. the elements of the RCU list and the I/O sessions. The slab allocator serves them from per-CPU
+ * freelists; the module only adds per-CPU counters of allocations, frees, failures and allocation latency,
+ * exposed through sysfs.
+ * @author Andrea Pepe
+ * @date April 22, 2023  
+*/
+
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/kernel.h>
+#include <linux/sched/clock.h>
+#include <linux/math64.h>
+
+#include "include/bldms.h"
+#include "include/cache.h"
+
+struct bldms_cache_stats {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long failures;
+    u64 alloc_ns;                   // total time spent in the allocations, failed ones included
+    u64 max_alloc_ns;               // slowest allocation
+};
+
+struct bldms_cache {
+    const char *name;
+    size_t size;
+    struct kmem_cache *cachep;
+    struct bldms_cache_stats __percpu *stats;
+};
+
+static struct bldms_cache bldms_caches[NR_BLDMS_CACHES] = {
+    [RCU_ELEM_CACHE] = { .name = "bldms_rcu_elem", .size = sizeof(rcu_elem) },
+    [SESSION_CACHE]  = { .name = "bldms_session", .size = sizeof(struct bldms_session) },
+};
+
+
+static inline void *cache_alloc(enum bldms_cache_id id, gfp_t flags){
+    struct bldms_cache *c = &bldms_caches[id];
+    struct bldms_cache_stats *s;
+    u64 start, ns;
+    void *obj;
+
+    start = local_clock();
+    obj = kmem_cache_zalloc(c->cachep, flags);
+    ns = local_clock() - start;
+
+    // objects are only allocated in process context, so disabling preemption is enough to update the counters
+    s = get_cpu_ptr(c->stats);
+    if (likely(obj))
+        s->allocs++;
+    else
+        s->failures++;
+    s->alloc_ns += ns;
+    if (ns > s->max_alloc_ns)
+        s->max_alloc_ns = ns;
+    put_cpu_ptr(c->stats);
+    return obj;
+}
+
+
+static inline void cache_free(enum bldms_cache_id id, void *obj){
+    struct bldms_cache *c = &bldms_caches[id];
+
+    kmem_cache_free(c->cachep, obj);
+    this_cpu_inc(c->stats->frees);
+}
+
+
+/**
+ * @brief  Allocate an element of the RCU list. Callers that do not hold any spinlock should pass GFP_KERNEL.
+ */
+rcu_elem *rcu_elem_alloc(gfp_t flags){
+    return cache_alloc(RCU_ELEM_CACHE, flags);
+}
+
+void rcu_elem_free(rcu_elem *el){
+    cache_free(RCU_ELEM_CACHE, el);
+}
+
+struct bldms_session *session_alloc(void){
+    return cache_alloc(SESSION_CACHE, GFP_KERNEL);
+}
+
+void session_free(struct bldms_session *session){
+    cache_free(SESSION_CACHE, session);
+}
+
+
+/**
+ * @brief  Create the slab caches of the module; called at module initialization.
+ */
+int bldms_caches_init(void){
+    int i;
+
+    for (i = 0; i < NR_BLDMS_CACHES; i++){
+        bldms_caches[i].stats = alloc_percpu(struct bldms_cache_stats);
+        if (!bldms_caches[i].stats)
+            goto err;
+        bldms_caches[i].cachep = kmem_cache_create(bldms_caches[i].name, bldms_caches[i].size, 0, SLAB_HWCACHE_ALIGN, NULL);
+        if (!bldms_caches[i].cachep)
+            goto err;
+    }
+    return 0;
+
+err:
+    bldms_caches_destroy();
+    return -ENOMEM;
+}
+
+
+/**
+ * @brief  Destroy the slab caches; all the objects must be already freed, including the ones
+ *         waiting for an RCU callback (see rcu_barrier()).
+ */
+void bldms_caches_destroy(void){
+    int i;
+
+    for (i = 0; i < NR_BLDMS_CACHES; i++){
+        kmem_cache_destroy(bldms_caches[i].cachep);
+        bldms_caches[i].cachep = NULL;
+        free_percpu(bldms_caches[i].stats);
+        bldms_caches[i].stats = NULL;
+    }
+}
+
+
+/**
+ * @brief  Print one line per cache, with the object size and the counters summed over all the CPUs:
+ *         the number of objects in use is the difference between allocations and frees; the latency of the
+ *         allocations is given as average and maximum, in nanoseconds.
+ */
+ssize_t bldms_caches_show(char *buf){
+    struct bldms_cache_stats *s;
+    unsigned long allocs, frees, failures;
+    u64 alloc_ns, max_alloc_ns;
+    ssize_t len = 0;
+    int i, cpu;
+
+    len += scnprintf(buf + len, PAGE_SIZE - len, "%-16s %8s %12s %12s %12s %8s %10s %10s\n",
+                    "cache", "objsize", "in_use", "allocs", "frees", "failures", "avg_ns", "max_ns");
+    for (i = 0; i < NR_BLDMS_CACHES; i++){
+        allocs = frees = failures = 0;
+        alloc_ns = max_alloc_ns = 0;
+        for_each_possible_cpu(cpu){
+            s = per_cpu_ptr(bldms_caches[i].stats, cpu);
+            allocs += s->allocs;
+            frees += s->frees;
+            failures += s->failures;
+            alloc_ns += s->alloc_ns;
+            max_alloc_ns = max(max_alloc_ns, s->max_alloc_ns);
+        }
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%-16s %8zu %12ld %12lu %12lu %8lu %10llu %10llu\n",
+                        bldms_caches[i].name, bldms_caches[i].size, (long)(allocs - frees), allocs, frees, failures,
+                        (allocs + failures) ? div64_u64(alloc_ns, allocs + failures) : 0ULL, max_alloc_ns);
+    }
+    return len;
+}
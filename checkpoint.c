@@ -0,0 +1,274 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file checkpoint.c
+ * @brief checkpoint of the index of the valid blocks. At a clean unmount, the valid blocks are saved in timestamp
+ * order in the checkpoint region of the device, and a clean flag is set in the superblock once everything is on disk.
+ * The next mount reads the checkpoint with a few sequential reads, instead of the whole metadata table, and clears the
+ * flag before the device can be modified: after a crash the flag is not set, and the device is fully scanned.
+ * @author Andrea Pepe
+ * @date April 22, 2023
+*/
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/string.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/crc32.h>
+
+#include "include/bldms.h"
+#include "include/device.h"
+#include "include/rcu.h"
+#include "include/durability.h"
+#include "include/checkpoint.h"
+
+
+#define CKPT_HEADER_SIZE sizeof(struct bldms_ckpt_header)
+// size of the records of the device "dev" in scope
+#define CKPT_REC_SIZE CKPT_RECORD_SIZE(dev->bldms_format)
+
+
+/*
+* Read the first "nblocks" blocks of the checkpoint region in the passed buffer: the reads of all of them are
+* submitted at once, before waiting for the first one.
+*/
+static int read_ckpt_blocks(struct bldms_dev *dev, char *buf, size_t nblocks){
+    struct super_block *sb = dev->sb;
+    struct buffer_head *bh;
+    struct blk_plug plug;
+    size_t i;
+
+    blk_start_plug(&plug);
+    for (i = 1; i < nblocks; i++)
+        sb_breadahead(sb, ckpt_block_nr(dev) + i);
+    blk_finish_plug(&plug);
+
+    for (i = 0; i < nblocks; i++){
+        bh = sb_bread(sb, ckpt_block_nr(dev) + i);
+        if (!bh)
+            return -EIO;
+        memcpy(buf + i * DEFAULT_BLOCK_SIZE, bh->b_data, DEFAULT_BLOCK_SIZE);
+        brelse(bh);
+    }
+    return 0;
+}
+
+
+// decode the record of index "i" of the passed records, according to the format version of the device
+static inline void ckpt_record_get(struct bldms_dev *dev, const char *rec, size_t i, struct valid_desc *desc){
+    const struct bldms_ckpt_record_v2 *v2;
+    const struct bldms_ckpt_record *v3;
+
+    if (dev->bldms_format == BLDMS_FORMAT_V2){
+        v2 = (const struct bldms_ckpt_record_v2 *)rec + i;
+        desc->ndx = v2->ndx;
+        desc->md = v2->md;
+    }else{
+        v3 = (const struct bldms_ckpt_record *)rec + i;
+        desc->ndx = v3->ndx;
+        desc->md = v3->md;
+    }
+}
+
+
+// encode the valid block "el" in the record of index "i" of the passed records
+static inline void ckpt_record_put(struct bldms_dev *dev, char *rec, size_t i, rcu_elem *el){
+    bldms_block md;
+    struct bldms_ckpt_record_v2 *v2;
+    struct bldms_ckpt_record *v3;
+
+    md.nsec = el->nsec;
+    md.valid_bytes = el->valid_bytes;
+    md.is_valid = BLK_VALID;
+    if (dev->bldms_format == BLDMS_FORMAT_V2){
+        v2 = (struct bldms_ckpt_record_v2 *)rec + i;
+        v2->ndx = el->ndx;
+        v2->md = md;
+    }else{
+        v3 = (struct bldms_ckpt_record *)rec + i;
+        v3->ndx = el->ndx;
+        v3->md = md;
+    }
+}
+
+
+/**
+ * @brief  Load the headers of the valid blocks from the checkpoint region.
+ *         The checkpoint is rejected if its checksum does not match, or if its records are not valid blocks of
+ *         the device in strictly increasing (timestamp, index) order.
+ * @param  valid: filled with the valid blocks in (timestamp, index) order, to be freed with kvfree()
+ * @param  nr_valid: filled with the number of valid blocks
+ * @retval 0 if ok, -EIO if a block can not be read, -EINVAL if the checkpoint is not valid, -ENOMEM
+ */
+int load_checkpoint(struct bldms_dev *dev, struct valid_desc **valid, size_t *nr_valid){
+    struct bldms_ckpt_header hdr;
+    struct buffer_head *bh;
+    char *rec, *buf = NULL;
+    size_t i, n, nblocks;
+    ktime_t start = ktime_get();
+    int ret = -EINVAL;
+
+    *valid = NULL;
+    *nr_valid = 0;
+
+    bh = sb_bread(dev->sb, ckpt_block_nr(dev));
+    if (!bh)
+        return -EIO;
+    memcpy(&hdr, bh->b_data, CKPT_HEADER_SIZE);
+    brelse(bh);
+
+    if (hdr.magic != CKPT_MAGIC || hdr.nr_valid > dev->md_array_size)
+        return -EINVAL;
+    n = hdr.nr_valid;
+    nblocks = DIV_ROUND_UP(CKPT_HEADER_SIZE + n * CKPT_REC_SIZE, DEFAULT_BLOCK_SIZE);
+
+    buf = kvmalloc(nblocks * DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+    if (n)
+        *valid = kvmalloc_array(n, sizeof(struct valid_desc), GFP_KERNEL);
+    if (!buf || (n && !*valid)){
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = read_ckpt_blocks(dev, buf, nblocks);
+    if (ret < 0)
+        goto out;
+
+    ret = -EINVAL;
+    rec = buf + CKPT_HEADER_SIZE;
+    if (crc32(~0, rec, n * CKPT_REC_SIZE) != hdr.crc)
+        goto out;
+
+    for (i = 0; i < n; i++){
+        ckpt_record_get(dev, rec, i, &(*valid)[i]);
+        if ((*valid)[i].ndx >= dev->md_array_size || (*valid)[i].md.is_valid != BLK_VALID)
+            goto out;
+        if (i > 0 && valid_desc_cmp(&(*valid)[i - 1], &(*valid)[i]) >= 0)
+            goto out;
+    }
+    *nr_valid = n;
+    ret = 0;
+
+    printk("%s: checkpoint of %lu valid blocks read in %lld us\n", MOD_NAME, n, ktime_us_delta(ktime_get(), start));
+
+out:
+    kvfree(buf);
+    if (ret < 0){
+        kvfree(*valid);
+        *valid = NULL;
+    }
+    return ret;
+}
+
+
+/**
+ * @brief  Save the valid blocks in the checkpoint region, in (timestamp, index) order. The records are collected
+ *         with the writing spinlock held, so that they are a consistent snapshot of the index, then they are copied
+ *         in the blocks of the region, which are marked as dirty: the caller has to make them durable.
+ *         The buffer of the records is sized on the number of valid blocks, not on the size of the region.
+ * @retval 0 if ok, -ENOMEM, -EIO, -EOVERFLOW if the indexes do not fit in the records of the device
+ */
+int write_checkpoint(struct bldms_dev *dev){
+    struct bldms_ckpt_header *hdr;
+    struct buffer_head *bh;
+    rcu_elem *el;
+    char *rec, *buf;
+    size_t i, n, max, nblocks;
+
+    // the records of the format version 2 can not keep bigger indexes
+    if (dev->bldms_format == BLDMS_FORMAT_V2 && dev->md_array_size > U32_MAX)
+        return -EOVERFLOW;
+
+    /*
+    * The valid blocks are counted first, then the buffer is allocated without holding the spinlock: if more blocks
+    * have become valid meanwhile, which does not happen at unmount, the buffer is allocated again.
+    */
+    n = 0;
+    spin_lock(&dev->rcu_write_lock);
+    list_for_each_entry(el, &dev->valid_blk_list, node)
+        n++;
+    spin_unlock(&dev->rcu_write_lock);
+
+retry:
+    max = n;
+    nblocks = DIV_ROUND_UP(CKPT_HEADER_SIZE + max * CKPT_REC_SIZE, DEFAULT_BLOCK_SIZE);
+    if (nblocks > dev->ckpt_blocks)
+        return -EOVERFLOW;
+    buf = kvzalloc(nblocks * DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    hdr = (struct bldms_ckpt_header *)buf;
+    rec = buf + CKPT_HEADER_SIZE;
+
+    n = 0;
+    spin_lock(&dev->rcu_write_lock);
+    list_for_each_entry(el, &dev->valid_blk_list, node){
+        if (n < max)
+            ckpt_record_put(dev, rec, n, el);
+        n++;
+    }
+    spin_unlock(&dev->rcu_write_lock);
+    if (n > max){
+        kvfree(buf);
+        goto retry;
+    }
+
+    hdr->magic = CKPT_MAGIC;
+    hdr->nr_valid = n;
+    hdr->crc = crc32(~0, rec, n * CKPT_REC_SIZE);
+
+    nblocks = DIV_ROUND_UP(CKPT_HEADER_SIZE + n * CKPT_REC_SIZE, DEFAULT_BLOCK_SIZE);
+    for (i = 0; i < nblocks; i++){
+        bh = sb_getblk(dev->sb, ckpt_block_nr(dev) + i);
+        if (!bh){
+            kvfree(buf);
+            return -EIO;
+        }
+        lock_buffer(bh);
+        memcpy(bh->b_data, buf + i * DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_SIZE);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+    kvfree(buf);
+
+    AUDIT
+        printk("%s: checkpoint of %lu valid blocks written\n", MOD_NAME, n);
+    return 0;
+}
+
+
+/**
+ * @brief  Set the clean flag of the superblock and make it durable, together with all the dirty buffers of the device.
+ * @retval 0 if ok, -EIO if the superblock can not be read, the error of the flush otherwise
+ */
+int set_clean_flag(struct bldms_dev *dev, uint64_t clean){
+    struct buffer_head *bh;
+
+    bh = sb_bread(dev->sb, SB_BLOCK_NUMBER);
+    if (!bh)
+        return -EIO;
+    lock_buffer(bh);
+    ((struct bldms_sb_info *)bh->b_data)->clean = clean;
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    return flush_whole_device(dev->sb->s_bdev);
+}
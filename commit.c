@@ -0,0 +1,182 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file commit.c
+ * @brief group commit of the synchronous writes on the device. The first writer that asks for a buffer to be
+ * made durable opens a batch and becomes its leader: it waits for a short window, during which other writers
+ * join the batch, then it submits all the buffers of the batch at once, waits for them and issues a single
+ * flush of the device cache. All the writers of the batch return when the flush completes.
+ * @author Andrea Pepe
+ * @date April 22, 2023  
+*/
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/atomic.h>
+
+#include "include/bldms.h"
+#include "include/commit.h"
+#include "include/device.h"
+
+unsigned int commit_window_us = COMMIT_WINDOW_US;
+module_param(commit_window_us, uint, 0644);
+MODULE_PARM_DESC(commit_window_us, "Microseconds the leader of a group commit waits for other writers to join it");
+
+struct commit_batch {
+    struct buffer_head *bhs[COMMIT_MAX_BATCH];
+    struct block_device *bdev;              // device of all the buffers of the batch
+    unsigned int count;
+    int error;
+    atomic_t refcount;                      // one reference for each writer of the batch
+    struct completion done;
+};
+
+/*
+* A batch is flushed with a single flush of its device, so it only keeps buffers of the same device: each device has
+* an open batch and a mutex of its own, so that the writers of different devices never replace each other's batch,
+* and the batches of different devices are run by their leaders in parallel.
+*/
+
+
+static inline void put_batch(struct commit_batch *batch){
+    if (atomic_dec_and_test(&batch->refcount))
+        kfree(batch);
+}
+
+
+static inline int flush_device(struct block_device *bdev){
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+    return blkdev_issue_flush(bdev, GFP_KERNEL, NULL);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+    return blkdev_issue_flush(bdev, GFP_KERNEL);
+#else
+    return blkdev_issue_flush(bdev);
+#endif
+}
+
+
+/**
+ * @brief  Write all the buffers of a closed batch and flush the device cache once.
+ */
+static void run_batch(struct commit_batch *batch){
+    unsigned int i;
+    int ret;
+
+    // submit all the writes before waiting for any of them, so that they can be merged by the block layer
+    for (i = 0; i < batch->count; i++)
+        write_dirty_buffer(batch->bhs[i], REQ_SYNC);
+
+    for (i = 0; i < batch->count; i++){
+        wait_on_buffer(batch->bhs[i]);
+        if (!buffer_uptodate(batch->bhs[i]))
+            batch->error = -EIO;
+    }
+
+    ret = flush_device(batch->bdev);
+    if (ret && !batch->error)
+        batch->error = ret;
+
+    for (i = 0; i < batch->count; i++)
+        brelse(batch->bhs[i]);
+}
+
+
+/**
+ * @brief  Make the content of several dirty buffers of the same device durable at once, as a batch of its own:
+ *         all the writes are submitted together, then the device cache is flushed once. The buffers are not
+ *         released. It must be called without any spinlock held, since it sleeps.
+ * @retval 0 if all the buffers have been written and the device cache flushed, a negative error code otherwise.
+ */
+int commit_buffers(struct buffer_head **bhs, unsigned int n){
+    unsigned int i;
+    int ret = 0, err;
+
+    if (n == 0)
+        return 0;
+
+    for (i = 0; i < n; i++)
+        write_dirty_buffer(bhs[i], REQ_SYNC);
+
+    for (i = 0; i < n; i++){
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i]))
+            ret = -EIO;
+    }
+
+    err = flush_device(bhs[0]->b_bdev);
+    return ret ? ret : err;
+}
+
+
+/**
+ * @brief  Make the content of a dirty buffer of the device durable, together with the buffers of the writers
+ *         of the same device that call this function at about the same time. It must be called without any spinlock held, since it sleeps.
+ * @retval 0 if the buffer has been written and the device cache flushed, a negative error code otherwise.
+ */
+int commit_buffer(struct bldms_dev *dev, struct buffer_head *bh){
+    struct commit_batch *batch;
+    bool leader = false;
+    int ret;
+
+    mutex_lock(&dev->commit_mutex);
+    batch = dev->open_batch;
+    if (!batch || batch->count == COMMIT_MAX_BATCH){
+        // no batch to join: open a new one and lead it; a full batch is already waited for by its own leader
+        batch = kzalloc(sizeof(struct commit_batch), GFP_KERNEL);
+        if (!batch){
+            mutex_unlock(&dev->commit_mutex);
+            // fall back to a single synchronous write
+            return sync_dirty_buffer(bh);
+        }
+        init_completion(&batch->done);
+        atomic_set(&batch->refcount, 1);
+        batch->bdev = bh->b_bdev;
+        dev->open_batch = batch;
+        leader = true;
+    }else{
+        atomic_inc(&batch->refcount);
+    }
+    get_bh(bh);
+    batch->bhs[batch->count++] = bh;
+    mutex_unlock(&dev->commit_mutex);
+
+    if (leader){
+        // let the other writers join the batch, then close it
+        if (commit_window_us)
+            usleep_range(commit_window_us, commit_window_us + commit_window_us / 4 + 1);
+
+        mutex_lock(&dev->commit_mutex);
+        if (dev->open_batch == batch)
+            dev->open_batch = NULL;
+        mutex_unlock(&dev->commit_mutex);
+
+        run_batch(batch);
+        complete_all(&batch->done);
+    }else{
+        wait_for_completion(&batch->done);
+    }
+
+    ret = batch->error;
+    put_batch(batch);
+    return ret;
+}
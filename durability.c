@@ -0,0 +1,220 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file durability.c
+ * @brief durability modes of the writes on the device, chosen at mount time through the "durability" option
+ * and changeable at runtime through sysfs. The mode is mapped on static keys, so that the system calls
+ * do not pay any check for it; the periodic mode relies on a delayed work that flushes all the mounted devices.
+ * @author Andrea Pepe
+ * @date April 22, 2023  
+*/
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
+#include <linux/version.h>
+
+#include "include/bldms.h"
+#include "include/durability.h"
+
+DEFINE_STATIC_KEY_FALSE(durability_sync_key);
+DEFINE_STATIC_KEY_FALSE(durability_group_key);
+
+unsigned int flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+
+static const char * const durability_names[NR_DURABILITY_MODES] = {
+    [DURABILITY_SYNC]     = "sync",
+    [DURABILITY_ASYNC]    = "async",
+    [DURABILITY_GROUP]    = "group",
+    [DURABILITY_PERIODIC] = "periodic",
+};
+
+static DEFINE_MUTEX(durability_mutex);      // serializes mode changes, mount and unmount
+static enum durability_mode current_mode = DEFAULT_DURABILITY_MODE;
+static LIST_HEAD(durability_devs);          // mounted devices; the list is empty if none is mounted
+static DEFINE_MUTEX(durability_devs_mutex); // protects the list, also against the periodic work
+
+static void periodic_flush(struct work_struct *work);
+static DECLARE_DELAYED_WORK(periodic_flush_work, periodic_flush);
+
+
+/**
+ * @brief  Write all the dirty buffers of the device and flush its volatile cache.
+ * @retval 0 if ok, the error of the writeback or of the flush otherwise
+ */
+int flush_whole_device(struct block_device *bdev){
+    int ret, err;
+
+    ret = sync_blockdev(bdev);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+    err = blkdev_issue_flush(bdev, GFP_KERNEL, NULL);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+    err = blkdev_issue_flush(bdev, GFP_KERNEL);
+#else
+    err = blkdev_issue_flush(bdev);
+#endif
+    return ret ? ret : err;
+}
+
+
+static void periodic_flush(struct work_struct *work){
+    struct bldms_dev *dev;
+
+    mutex_lock(&durability_devs_mutex);
+    list_for_each_entry(dev, &durability_devs, durability_node)
+        flush_whole_device(dev->sb->s_bdev);
+    if (!list_empty(&durability_devs))
+        schedule_delayed_work(&periodic_flush_work, msecs_to_jiffies(READ_ONCE(flush_interval_ms)));
+    mutex_unlock(&durability_devs_mutex);
+}
+
+
+/**
+ * @brief  Switch the static keys and the periodic work to the passed mode; durability_mutex must be held.
+ */
+static void apply_mode(enum durability_mode mode){
+    /*
+    * Start the new mode before stopping the previous one: a racing writer sees the old mode, the new one or both
+    * of them, never none. With both keys enabled, the group commit is used.
+    */
+    if (mode == DURABILITY_SYNC)
+        static_branch_enable(&durability_sync_key);
+    else if (mode == DURABILITY_GROUP)
+        static_branch_enable(&durability_group_key);
+    else if (mode == DURABILITY_PERIODIC && !list_empty(&durability_devs))
+        schedule_delayed_work(&periodic_flush_work, msecs_to_jiffies(flush_interval_ms));
+
+    if (mode != DURABILITY_SYNC)
+        static_branch_disable(&durability_sync_key);
+    if (mode != DURABILITY_GROUP)
+        static_branch_disable(&durability_group_key);
+    if (current_mode == DURABILITY_PERIODIC && mode != DURABILITY_PERIODIC)
+        cancel_delayed_work_sync(&periodic_flush_work);
+
+    current_mode = mode;
+}
+
+
+int durability_mode_from_name(const char *name){
+    int i;
+
+    for (i = 0; i < NR_DURABILITY_MODES; i++){
+        if (sysfs_streq(name, durability_names[i]))
+            return i;
+    }
+    return -EINVAL;
+}
+
+
+const char *durability_mode_name(enum durability_mode mode){
+    return durability_names[mode];
+}
+
+
+enum durability_mode get_durability_mode(void){
+    return READ_ONCE(current_mode);
+}
+
+
+/**
+ * @brief  Change the durability mode at runtime; switching the static keys can sleep.
+ */
+int set_durability_mode(enum durability_mode mode){
+    if (mode >= NR_DURABILITY_MODES)
+        return -EINVAL;
+
+    mutex_lock(&durability_mutex);
+    if (mode != current_mode){
+        apply_mode(mode);
+        printk("%s: durability mode set to %s\n", MOD_NAME, durability_names[mode]);
+    }
+    mutex_unlock(&durability_mutex);
+    return 0;
+}
+
+
+/**
+ * @brief  Change the period of the flushes; in periodic mode, the next flush is rescheduled accordingly.
+ */
+void set_flush_interval(unsigned int ms){
+    mutex_lock(&durability_mutex);
+    WRITE_ONCE(flush_interval_ms, ms);
+    if (current_mode == DURABILITY_PERIODIC && !list_empty(&durability_devs))
+        mod_delayed_work(system_wq, &periodic_flush_work, msecs_to_jiffies(ms));
+    mutex_unlock(&durability_mutex);
+}
+
+
+/**
+ * @brief  Start flushing a device that is being mounted according to the current mode. The mode and the period
+ *         given at mount (a negative mode and a 0 period if not specified) are shared by all the devices: the first
+ *         device sets them, or gets back their default values; while other devices are mounted, a mount that asks
+ *         for a different mode or period is refused, so that it can not weaken the durability of the other devices.
+ * @retval 0 if ok, -EINVAL if the options conflict with the ones of the mounted devices
+ */
+int durability_start(struct bldms_dev *dev, int mode, unsigned int ms){
+    bool first;
+
+    mutex_lock(&durability_mutex);
+    mutex_lock(&durability_devs_mutex);
+    first = list_empty(&durability_devs);
+    if (!first && ((mode >= 0 && mode != current_mode) || (ms && ms != flush_interval_ms))){
+        mutex_unlock(&durability_devs_mutex);
+        mutex_unlock(&durability_mutex);
+        printk("%s: mounting error - durability %s with period %u ms requested, while the mounted devices use %s "
+                "with period %u ms\n", MOD_NAME, (mode >= 0) ? durability_names[mode] : durability_names[current_mode],
+                (ms) ? ms : flush_interval_ms, durability_names[current_mode], flush_interval_ms);
+        return -EINVAL;
+    }
+    list_add_tail(&dev->durability_node, &durability_devs);
+    mutex_unlock(&durability_devs_mutex);
+
+    if (first)
+        WRITE_ONCE(flush_interval_ms, (ms) ? ms : DEFAULT_FLUSH_INTERVAL_MS);
+    if (mode < 0)
+        mode = (first) ? DEFAULT_DURABILITY_MODE : current_mode;
+
+    // the keys are not touched if the mode does not change, so the writers of the other devices are not disturbed
+    if (mode != current_mode){
+        apply_mode(mode);
+        printk("%s: durability mode set to %s\n", MOD_NAME, durability_names[mode]);
+    }else if (mode == DURABILITY_PERIODIC){
+        mod_delayed_work(system_wq, &periodic_flush_work, msecs_to_jiffies(flush_interval_ms));
+    }
+    mutex_unlock(&durability_mutex);
+    return 0;
+}
+
+
+/**
+ * @brief  Stop flushing a device before it is unmounted; in periodic mode, it is flushed a last time.
+ */
+void durability_stop(struct bldms_dev *dev){
+    mutex_lock(&durability_mutex);
+    mutex_lock(&durability_devs_mutex);
+    list_del_init(&dev->durability_node);
+    mutex_unlock(&durability_devs_mutex);
+
+    if (current_mode == DURABILITY_PERIODIC){
+        // the work does not see the device anymore: it is flushed a last time here
+        flush_whole_device(dev->sb->s_bdev);
+        if (list_empty(&durability_devs))
+            cancel_delayed_work_sync(&periodic_flush_work);
+    }
+    mutex_unlock(&durability_mutex);
+}
@@ -36,6 +36,8 @@
 #include "include/bldms.h"
 #include "include/device.h"
 #include "include/rcu.h"
+#include "include/cache.h"
+#include "include/scan.h"
 
 
 /**
@@ -43,8 +45,9 @@
  * delivery of data. To do so, the read finds the next valid block to be read from an RCU-list of
  * valid blocks. The list is kept in timestamp order.
  * Each invocation of the read() returns at most the content of a single block. The block to be read in the following 
- * invokation, is determined in the previous one, and the expected timestamp is saved into the session.
- * Such value is used to determine if, in the meanwhile, the block has been invalidated and so what is the right block to return.
+ * invokation, is determined in the previous one, and its (timestamp, index) key is saved as a cursor into the session.
+ * Such value is used to determine if, in the meanwhile, the block has been invalidated and so what is the right block to return:
+ * if it is still valid it is found in O(1), otherwise its successor is found in O(log n).
  */
 ssize_t bldms_read(struct file *filp, char __user *buf, size_t len, loff_t *off){
 	struct buffer_head *bh = NULL;
@@ -52,15 +55,21 @@ ssize_t bldms_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
 	uint64_t file_sz = f_inode->i_size;
 	int ret;
 	loff_t offset;
-	uint32_t block_to_read, device_blk;
+	uint64_t block_to_read, device_blk;
 	rcu_elem *rcu_el, *next_el;
-	ktime_t *next_ts, *old_session_metadata;
+	struct bldms_session *session = (struct bldms_session *)filp->private_data;
+	struct bldms_dev *dev = BLDMS_DEV(f_inode->i_sb);
 
 	/*
 	 * this operation is not synchronized
 	 * *off can be changed concurrently
 	 */
 
+	// reads are delivered in timestamp order: in a lazy mount, they wait for the whole index to be built
+	ret = wait_scan_complete(dev);
+	if (ret)
+		return ret;
+
 	// check that *off is within boundaries
 	if ((*off + NUM_METADATA_BLKS * DEFAULT_BLOCK_SIZE) >= file_sz){
 		return 0;
@@ -84,48 +93,50 @@ ssize_t bldms_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
 
 	// compute the index of the block to be read (skipping superblocks and initial metadata blocks)
 	device_blk = *off / DEFAULT_BLOCK_SIZE;
-	block_to_read = device_blk + NUM_METADATA_BLKS;
+	block_to_read = data_block_nr(dev, device_blk);
 	AUDIT
-		printk("%s: read() operation asked for block number %d of the device",MOD_NAME, device_blk);
+		printk("%s: read() operation asked for block number %llu of the device",MOD_NAME, device_blk);
 
 	/* flag RCU read-side critical section beginning */
 	rcu_read_lock();
-	next_ts = (ktime_t *)filp->private_data;
-	list_for_each_entry_rcu(rcu_el, &valid_blk_list, node){
-		
-		if (rcu_el->ndx == device_blk){
-			// the block has been found in the RCU list, so it is valid
-			break;		
-		}else if (rcu_el->nsec > *next_ts){
-			/*
-			* The searched block has been invalidated between different read() calls:
-			* since the RCU list is timestamp ordered, finding a node with timestamp greater
-			* of the expected one means that the searched block is not in the RCU list anymore. 
-			* So, let's read the first element of the RCU list with timestamp bigger of the expected one, if any. 
-			*/
-			device_blk = rcu_el->ndx;
-			block_to_read = device_blk + NUM_METADATA_BLKS;
-			*off = (device_blk * DEFAULT_BLOCK_SIZE) + METADATA_SIZE;
-			offset = METADATA_SIZE;
-			len = (rcu_el->valid_bytes < len) ? rcu_el->valid_bytes : len;
-			break; 
+
+	/*
+	* The cursor of the session is the key of the expected block: if such block is still valid
+	* and keeps the same message, the per-block index gives it in constant time.
+	*/
+	rcu_el = (session->ndx < dev->md_array_size) ? lookup_valid_block(dev, session->ndx) : NULL;
+	if (!rcu_el || rcu_el->nsec != session->nsec){
+		/*
+		* The searched block has been invalidated between different read() calls:
+		* since the tree of valid blocks is ordered by key, let's read the first valid block
+		* with a key bigger than the expected one, if any.
+		*/
+		rcu_el = find_valid_block_from(dev, session->nsec, session->ndx);
+		if (!rcu_el){
+			// there is no valid node left to read
+			AUDIT
+				pr_info("%s: read() - no more messages after the session cursor\n", MOD_NAME);
+			ret = 0;
+			goto end_of_msgs;
 		}
+		session->nsec = rcu_el->nsec;
+		session->ndx = rcu_el->ndx;
 	}
 
-	// rcu_el is the element to be read
-
-	// to check if the tail of the list has been reached, we have to check if the node points to the head of the list
-	if (&(rcu_el->node) == &valid_blk_list){
-		// there is no valid node left to read
-		AUDIT
-			pr_info("%s: read() - no more messages (rcu_el is end of the list)\n", MOD_NAME);
-		ret = 0;
-		goto end_of_msgs;
+	if (rcu_el->ndx != device_blk){
+		// the offset does not refer to the expected block: start reading from the beginning of its message
+		device_blk = rcu_el->ndx;
+		block_to_read = data_block_nr(dev, device_blk);
+		*off = (device_blk * DEFAULT_BLOCK_SIZE) + METADATA_SIZE;
+		offset = METADATA_SIZE;
+		len = (rcu_el->valid_bytes < len) ? rcu_el->valid_bytes : len;
 	}
 
+	// rcu_el is the element to be read
 
 	if (offset - METADATA_SIZE > rcu_el->valid_bytes){
 		// this block has already been read; go to the next one
+		ret = 0;
 		goto set_next_blk;
 
 	}else if (len + offset - METADATA_SIZE > rcu_el->valid_bytes){
@@ -134,7 +145,7 @@ ssize_t bldms_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
 	}
 
 	// read the block and cache it in the buffer head
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, block_to_read);
+	bh = sb_bread(dev->sb, block_to_read);
 	if(!bh){
 		rcu_read_unlock();
 		return -EIO;
@@ -159,25 +170,18 @@ ssize_t bldms_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
 set_next_blk:
 	// get the next element in the RCU list (the next, in timestamp order, valid block)
 	next_el = rcu_next_elem(rcu_el);
-	if (&(next_el->node) == &valid_blk_list){
+	if (&(next_el->node) == &dev->valid_blk_list){
 		goto end_of_msgs;
 	}
 
-	// update the session metadata: call with GFP_ATOMIC to avoid sleeping
-	next_ts = kzalloc(sizeof(ktime_t), GFP_ATOMIC);
-	if(!next_ts){
-		rcu_read_unlock();
-		return -ENOMEM;
-	}
-	*next_ts = next_el->nsec;
-	old_session_metadata = (ktime_t *) filp->private_data;
-	filp->private_data = (void *)next_ts;
-	kfree(old_session_metadata);
+	// advance the cursor of the session to the next valid block, in O(1)
+	session->nsec = next_el->nsec;
+	session->ndx = next_el->ndx;
 
 	/*
 	* set the offset to the beginning of data of the next valid block:
 	* this is not strictly necessary, since the message delivered on the next call
-	* will be typically determined by the timestamp registered in the session structure
+	* will be typically determined by the cursor registered in the session structure
 	*/
 	*off = (next_el->ndx * DEFAULT_BLOCK_SIZE) + METADATA_SIZE;
 
@@ -185,7 +189,7 @@ set_next_blk:
 	// signal the end of the RCU read-side critical section
 	rcu_read_unlock();
 	AUDIT
-		printk("%s: read() operation actually read block number %d of the device",MOD_NAME, device_blk);
+		printk("%s: read() operation actually read block number %llu of the device",MOD_NAME, device_blk);
 	// return the number of read bytes
 	return ret;
 
@@ -271,30 +275,30 @@ struct dentry *bldms_lookup(struct inode *parent_inode, struct dentry *child_den
 }
 
 /**
- * @brief  If the open is called with READ access permissions, a memory area will be allocated
- * and a reference will be kept inside the session. Such area will be used to keep the timestamp of the next
+ * @brief  If the open is called with READ access permissions, a session struct will be allocated
+ * and a reference will be kept inside the session. Such area will be used to keep the cursor, i.e. the key, of the next
  * expected valid block of the device that a read operation should retrieve. It provides consistency between different
  * calls to the read() operation. 
  */
 int bldms_open(struct inode *inode, struct file *filp){
-	ktime_t *nsec;
-	if(!bldms_mounted){
+	struct bldms_session *session;
+	if(!BLDMS_DEV(inode->i_sb)->mounted){
 		return -ENODEV;
 	}
-	// increment module usage count
-	try_module_get(THIS_MODULE);
 
 	if ((filp->f_flags & O_ACCMODE) == O_RDONLY || (filp->f_flags & O_ACCMODE) == O_RDWR){
-		// initialize the I/O session private data: timestamp of the next valid block to be read; init to 0;
-		nsec = kzalloc(sizeof(ktime_t), GFP_ATOMIC);
-		if(!nsec)
+		// initialize the I/O session private data: the cursor starts before the first valid block
+		session = session_alloc();
+		if(!session)
 			return -ENOMEM;
-		*nsec = 0;
-		filp->private_data = (void *)nsec;
+		filp->private_data = (void *)session;
 		AUDIT
 			pr_info("%s: the device has been opened in RDONLY mode; session's private data initialized\n", MOD_NAME);
 	}
 
+	// increment module usage count
+	try_module_get(THIS_MODULE);
+
 	inode->i_size = filp->f_inode->i_size;	
 	return 0;
 }
@@ -305,13 +309,13 @@ int bldms_open(struct inode *inode, struct file *filp){
  * keep information inside the session, if the device has been opened in READ mode.
  */
 int bldms_release(struct inode *inode, struct file *filp){
-	if(!bldms_mounted){
+	if(!BLDMS_DEV(inode->i_sb)->mounted){
 		return -ENODEV;
 	}
 	
 	if ((filp->f_flags & O_ACCMODE) == O_RDONLY || (filp->f_flags & O_ACCMODE) == O_RDWR){
 		if(filp->private_data){
-			kfree(filp->private_data);
+			session_free(filp->private_data);
 		}
 	}
 	
@@ -327,32 +331,26 @@ int bldms_release(struct inode *inode, struct file *filp){
  * @brief  This llseek operation has been implemented with the only purpose of giving
  * the possibility to restart reading all the messages on the device from the beginning
  * without the necessity of releasing the session and opening another one.
- * This can only been called with SEEK_SET and offset 0. In such a case, the metadata maintained
+ * This can only been called with SEEK_SET and offset 0. In such a case, the cursor maintained
  * in the session will be reset to a state as if the file has just been opened.
  */
 loff_t bldms_llseek(struct file *filp, loff_t off, int whence){
-	ktime_t *nsec, *old_nsec;
+	struct bldms_session *session;
 
-	if(!bldms_mounted){
+	if(!BLDMS_DEV(file_inode(filp)->i_sb)->mounted){
 		return -ENODEV;
 	}
 
 	switch(whence){
 		case SEEK_SET:
 			if(off == 0 && filp->private_data != NULL){
-				nsec = kzalloc(sizeof(ktime_t), GFP_ATOMIC);
-				if (!nsec){
-					printk("%s: llseek() invoked but returned error in allocation of memory\n", MOD_NAME);
-					return -ENOMEM;
-				}
-				*nsec = 0;
-				//TODO: change this to an atomic exchange and mfence
-				old_nsec = filp->private_data;
-				filp->private_data = nsec;
+				// the session is reused: just move the cursor back before the first valid block
+				session = (struct bldms_session *)filp->private_data;
+				session->nsec = 0;
+				session->ndx = 0;
 				filp->f_pos = 0;
-				kfree(old_nsec);
 				AUDIT
-					printk("%s: llseek() invoked - timestamp saved in the session has been reset\n", MOD_NAME);
+					printk("%s: llseek() invoked - cursor saved in the session has been reset\n", MOD_NAME);
 			}else{
 				printk("%s: llseek() not allowed on offset different from zero or on file not opened in read mode\n", MOD_NAME);
 				return -EINVAL;
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef __BLDMS_ALLOC_H__
+#define __BLDMS_ALLOC_H__
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+
+#define BLK_POOL_SIZE 16                    // number of free blocks reserved at once by a CPU
+#define MAX_ALLOC_GROUPS 64                 // maximum number of independently locked groups of the device
+#define ALLOC_GROUP_MIN_BLOCKS 4096         // minimum number of blocks of an allocation group
+
+#include "device.h"
+
+/*
+* Free-space bitmap of the device, kept in its struct bldms_dev: a bit is set when the corresponding block keeps
+* a valid message or is reserved in a per-CPU pool, waiting for a put_data() to use it.
+*/
+
+// range of blocks of the device, whose part of the bitmap is protected by its own lock
+struct alloc_group {
+    spinlock_t lock;
+    size_t first;                           // first block of the group
+    size_t end;                             // first block after the group
+    size_t nr_free;                         // number of free blocks in the group
+} ____cacheline_aligned_in_smp;
+
+// per-CPU pool of reserved free blocks, used in FIFO order to preserve the circular allocation order
+struct blk_pool {
+    spinlock_t lock;
+    unsigned int next;
+    unsigned int count;
+    uint64_t blocks[BLK_POOL_SIZE];
+};
+
+/* functions */
+extern int blk_bitmap_init(struct bldms_dev *dev, size_t nblocks);
+extern void blk_bitmap_fill(struct bldms_dev *dev);
+extern void blk_bitmap_free(struct bldms_dev *dev);
+extern void mark_block_used(struct bldms_dev *dev, uint64_t ndx);
+extern void release_block(struct bldms_dev *dev, uint64_t ndx);
+extern long alloc_free_block(struct bldms_dev *dev);
+extern unsigned int alloc_free_blocks(struct bldms_dev *dev, uint64_t *blocks, unsigned int n);
+extern void blk_pools_drain(struct bldms_dev *dev);
+extern ssize_t blk_alloc_show(struct bldms_dev *dev, char *buf, ssize_t len);
+#endif
@@ -11,8 +11,9 @@
 #define MAGIC 0x30303030
 #define DEFAULT_BLOCK_SIZE 4096
 
+// default of the max_blocks module parameter: 0 for no limit
 #ifndef NBLOCKS
-    #define NBLOCKS 1000
+    #define NBLOCKS 0
 #endif
 
 #define SB_BLOCK_NUMBER 0
@@ -24,6 +25,19 @@
 #define BLDMS_INODES_BLOCK_NUMBER 1
 #define FILENAME_MAX_LEN 255
 
+/*
+* On-disk format versions:
+*   - 1: the header of each block is kept in the first bytes of the block itself;
+*   - 2: the headers of all the blocks are packed in a metadata table, placed after the inode block;
+*        it can be followed by a checkpoint region, where the index of the valid blocks is saved at a clean unmount,
+*        with 32-bit block indexes;
+*   - 3: the same layout of version 2, with 64-bit block indexes in the checkpoint region, that is bigger.
+*/
+#define BLDMS_FORMAT_V1 1
+#define BLDMS_FORMAT_V2 2
+#define BLDMS_FORMAT_V3 3
+#define BLDMS_FORMAT_VERSION BLDMS_FORMAT_V3
+
 #define BLK_INVALID (0)
 #define BLK_VALID (BLK_INVALID + 1)
 
@@ -33,8 +47,25 @@
 #define AUDIT if(DEBUG)
 
 
-extern unsigned char bldms_mounted;
-extern struct super_block *the_dev_superblock;
+// several devices can be mounted at once: the system calls without a device id work on the device of id 0
+#define BLDMS_MAX_DEVS 64
+#define BLDMS_DEFAULT_DEV 0
+
+// maximum number of messages handled by a single put_data_batch() or get_data_multi()
+#define BLDMS_MAX_BATCH 64
+
+// descriptor of a message passed to put_data_batch(): the same as the arguments of put_data()
+struct bldms_put_desc {
+    char *source;
+    size_t size;
+};
+
+// descriptor of a block requested through get_data_multi(): the same as the arguments of get_data()
+struct bldms_get_desc {
+    long offset;
+    char *destination;
+    size_t size;
+};
 
 
 
@@ -60,9 +91,12 @@ struct bldms_dir_record {
 struct bldms_sb_info {
     uint64_t version;
     uint64_t magic;
+    uint64_t md_table_blocks;                       // number of blocks of the metadata table (version 2 only)
+    uint64_t ckpt_blocks;                           // number of blocks of the checkpoint region, 0 if there is none
+    uint64_t clean;                                 // 1 if the device was cleanly unmounted and the checkpoint is valid
 
     //padding to fit into a single block
-    char padding[ DEFAULT_BLOCK_SIZE - (2 * sizeof(uint64_t))];
+    char padding[ DEFAULT_BLOCK_SIZE - (5 * sizeof(uint64_t))];
 };
 
 
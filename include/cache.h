@@ -0,0 +1,25 @@
+#pragma once
+#ifndef __BLDMS_CACHE_H__
+#define __BLDMS_CACHE_H__
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+#include "rcu.h"
+#include "device.h"
+
+// objects served by the dedicated slab caches of the module
+enum bldms_cache_id {
+    RCU_ELEM_CACHE,
+    SESSION_CACHE,
+    NR_BLDMS_CACHES
+};
+
+int bldms_caches_init(void);
+void bldms_caches_destroy(void);
+rcu_elem *rcu_elem_alloc(gfp_t flags);
+void rcu_elem_free(rcu_elem *el);
+struct bldms_session *session_alloc(void);
+void session_free(struct bldms_session *session);
+ssize_t bldms_caches_show(char *buf);
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef __BLDMS_CHECKPOINT_H__
+#define __BLDMS_CHECKPOINT_H__
+
+#include <linux/types.h>
+#include "bldms.h"
+#include "device.h"
+
+#define CKPT_MAGIC 0x434b5054               // "CKPT"
+
+/*
+* The checkpoint region follows the metadata table: it starts with a header, followed by one record for each
+* valid block, in (timestamp, index) order. Records are packed and can span two blocks of the region.
+*/
+struct bldms_ckpt_header {
+    uint32_t magic;
+    uint32_t crc;                           // crc32 of the records
+    uint64_t nr_valid;                      // number of records
+};
+
+// record of the format version 3
+struct __attribute__((packed)) bldms_ckpt_record {
+    uint64_t ndx;
+    bldms_block md;
+};
+
+// record of the format version 2, whose devices have less than 2^32 blocks
+struct __attribute__((packed)) bldms_ckpt_record_v2 {
+    uint32_t ndx;
+    bldms_block md;
+};
+
+#define CKPT_RECORD_SIZE(format) \
+        (((format) == BLDMS_FORMAT_V2) ? sizeof(struct bldms_ckpt_record_v2) : sizeof(struct bldms_ckpt_record))
+
+// blocks needed by the checkpoint of a device of "nblocks" blocks, when all of them are valid
+#define CKPT_BLOCKS(nblocks, format) \
+        ((sizeof(struct bldms_ckpt_header) + (nblocks) * CKPT_RECORD_SIZE(format) + DEFAULT_BLOCK_SIZE - 1) / DEFAULT_BLOCK_SIZE)
+
+// first device block of the checkpoint region
+#define ckpt_block_nr(dev) (NUM_METADATA_BLKS + (dev)->md_table_blocks)
+
+int load_checkpoint(struct bldms_dev *dev, struct valid_desc **valid, size_t *nr_valid);
+int write_checkpoint(struct bldms_dev *dev);
+int set_clean_flag(struct bldms_dev *dev, uint64_t clean);
+
+#endif
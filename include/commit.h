@@ -0,0 +1,17 @@
+#pragma once
+#ifndef __BLDMS_COMMIT_H__
+#define __BLDMS_COMMIT_H__
+
+#include <linux/buffer_head.h>
+
+#define COMMIT_MAX_BATCH 64                 // maximum number of buffers flushed by a single group commit
+#define COMMIT_WINDOW_US 200                // default time the leader of a batch waits for other writers to join
+
+struct bldms_dev;
+
+extern unsigned int commit_window_us;
+
+int commit_buffer(struct bldms_dev *dev, struct buffer_head *bh);
+int commit_buffers(struct buffer_head **bhs, unsigned int n);
+
+#endif
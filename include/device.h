@@ -4,6 +4,18 @@
 
 #include <linux/ktime.h>
 #include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/percpu-refcount.h>
+#include <linux/completion.h>
+#include <linux/rcupdate.h>
 
 // device's block metadata
 typedef struct __attribute__((packed)) bldms_block{
@@ -15,8 +27,109 @@ typedef struct __attribute__((packed)) bldms_block{
 #define METADATA_SIZE sizeof(bldms_block)   // 10 bytes
 #define NUM_METADATA_BLKS 2 		        // superblock + unique file inode
 
-extern bldms_block **metadata_array;
-extern size_t md_array_size;
-extern uint32_t last_written_block;
+// format version 2: headers packed in a table, entries do not span two blocks
+#define MD_ENTRIES_PER_BLOCK (DEFAULT_BLOCK_SIZE / METADATA_SIZE)     // 409
+#define MD_TABLE_BLOCKS(nblocks) (((nblocks) + MD_ENTRIES_PER_BLOCK - 1) / MD_ENTRIES_PER_BLOCK)
+
+// I/O session of the unique file, kept in the private_data field of the struct file
+struct bldms_session {
+    ktime_t nsec;                           // timestamp of the next block to be read
+    uint64_t ndx;                           // index of the next block to be read
+};
+
+// valid block found on the device at mount time
+struct valid_desc {
+    uint64_t ndx;
+    bldms_block md;
+};
+
+struct _rcu_elem;
+struct alloc_group;
+struct blk_pool;
+struct commit_batch;
+
+/*
+* State of a mounted device, kept in the s_fs_info field of its superblock: each device has its own index,
+* writing spinlock and free-space bitmap, so that operations on different devices never share a lock.
+* The system calls choose the device through its id, given at mount time.
+*/
+struct bldms_dev {
+    int id;                                 // id of the device for the system calls, -1 until it is registered
+    struct super_block *sb;
+    unsigned char mounted;                  // set once the device is registered; system calls fail with ENODEV otherwise
+    struct percpu_ref users;                // held by the system calls currently working on the device
+    struct completion users_done;           // completed once the unmount has waited for all the system calls
+    struct rcu_head rcu;                    // the state is freed after a grace period, lookups may still see it
+    struct list_head durability_node;       // link in the list of the devices flushed in periodic mode
+    struct mutex commit_mutex;              // protects the open group commit batch of the device
+    struct commit_batch *open_batch;        // batch that writers of the device can still join, if any
+
+    // layout of the device
+    size_t md_array_size;                   // number of blocks of the device
+    unsigned int bldms_format;              // on-disk format version of the device
+    uint64_t md_table_blocks;               // number of blocks of the metadata table, 0 for version 1
+    uint64_t ckpt_blocks;                   // number of blocks of the checkpoint region, 0 if there is none
+
+    // index of the valid blocks (rcu.c)
+    struct list_head valid_blk_list;        // RCU-list of currently valid blocks of the device
+    spinlock_t rcu_write_lock;              // spinlock used for write operations on the RCU-list, in order to synchronize concurrent writers
+    struct rb_root valid_blk_tree;          // tree of the valid blocks, ordered by (timestamp, index)
+    seqcount_t valid_blk_seq;               // lets lockless tree lookups detect concurrent rebalancing
+    ktime_t last_timestamp;                 // biggest timestamp assigned to a message of the device
+    struct _rcu_elem __rcu ***valid_blk_index;  // per-block index of the RCU-list: O(1) lookup of a block's rcu_elem
+    size_t nr_index_dir;                    // number of entries of the directory of the per-block index
+    atomic_long_t nr_index_pages;           // number of allocated pages of the per-block index
+
+    // free blocks (alloc.c)
+    unsigned long *blk_bitmap;              // a set bit means the block is valid or reserved in a pool
+    atomic_long_t nr_free_blocks;           // number of clear bits of the bitmap
+    struct alloc_group *alloc_groups;       // allocation groups the bitmap is split into
+    unsigned int nr_alloc_groups;
+    size_t group_blocks;                    // number of blocks of each group (but the last one)
+    struct blk_pool __percpu *blk_pools;    // per-CPU pools of reserved free blocks
+    atomic_t nr_pooled_blocks;              // number of blocks currently kept in the pools
+    uint64_t last_written_block;            // last block reserved by the allocator
+
+    // lazy mount (scan.c)
+    int scan_done;                          // no scan is in progress unless a lazy mount starts one
+    wait_queue_head_t scan_wq;
+    struct mutex scan_mutex;                // serializes the worker and the on-demand scans
+    unsigned long *scanned_map;             // blocks whose header has already been scanned
+    struct work_struct scan_work;
+    int scan_abort;                         // set at unmount, to stop the worker
+    int scan_ok;                            // set by the worker when all the blocks have been scanned
+};
+
+static inline struct bldms_dev *BLDMS_DEV(struct super_block *sb){
+    return sb->s_fs_info;
+}
+
+// device block keeping the message of the block of index "ndx"
+#define data_block_nr(dev, ndx) ((ndx) + NUM_METADATA_BLKS + (dev)->md_table_blocks + (dev)->ckpt_blocks)
+
+// the headers are kept in a metadata table from the format version 2 on
+#define has_md_table(dev) ((dev)->bldms_format != BLDMS_FORMAT_V1)
+
+// device block and offset keeping the header of the block of index "ndx"
+#define md_block_nr(dev, ndx) \
+        (has_md_table(dev) ? (NUM_METADATA_BLKS + (ndx) / MD_ENTRIES_PER_BLOCK) : data_block_nr(dev, ndx))
+#define md_block_offset(dev, ndx) \
+        (has_md_table(dev) ? ((ndx) % MD_ENTRIES_PER_BLOCK) * METADATA_SIZE : 0)
+
+/* functions (bldms.c) */
+extern struct bldms_dev *bldms_dev_get(int id);
+extern void bldms_dev_put(struct bldms_dev *dev);
+extern ssize_t bldms_devs_show(char *buf);
+extern ssize_t bldms_devs_free_space_show(char *buf);
+
+/* functions (metadata.c) */
+struct buffer_head;
+extern uint64_t md_first_ndx(struct bldms_dev *dev, sector_t blk);
+extern void scan_readahead(struct super_block *sb, sector_t blk, sector_t *ra, sector_t last);
+extern int load_metadata(struct bldms_dev *dev, struct valid_desc **valid, size_t *nr_valid);
+extern int valid_desc_cmp(const void *a, const void *b);
+extern struct buffer_head *read_metadata_block(struct bldms_dev *dev, uint64_t ndx);
+extern struct buffer_head *get_metadata_block(struct bldms_dev *dev, uint64_t ndx);
+extern void update_metadata(struct bldms_dev *dev, struct buffer_head *bh, uint64_t ndx);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+#pragma once
+#ifndef __BLDMS_DURABILITY_H__
+#define __BLDMS_DURABILITY_H__
+
+#include <linux/types.h>
+#include <linux/jump_label.h>
+#include <linux/buffer_head.h>
+#include "commit.h"
+#include "device.h"
+
+// compilation-time directive that chooses the default durability mode: group commit if set, writeback daemon otherwise
+#ifndef SYNCHRONOUS_PUT_DATA
+    #define SYNCHRONOUS_PUT_DATA 1
+#endif
+
+#define DEFAULT_FLUSH_INTERVAL_MS 1000      // default period of the flushes in periodic mode
+
+/*
+* Durability modes of the writes on the device:
+*   - sync: each write is flushed on its own before the system call returns;
+*   - async: writes are left to the writeback daemon;
+*   - group: concurrent writes are flushed together, with a single flush of the device cache (see commit.c);
+*   - periodic: writes are left in the cache and the whole device is flushed every flush_interval_ms milliseconds.
+* The mode and the period are shared by all the mounted devices, since the static keys are global: a mount that asks
+* for a different mode or period while other devices are mounted is refused.
+*/
+enum durability_mode {
+    DURABILITY_SYNC,
+    DURABILITY_ASYNC,
+    DURABILITY_GROUP,
+    DURABILITY_PERIODIC,
+    NR_DURABILITY_MODES
+};
+
+#define DEFAULT_DURABILITY_MODE (SYNCHRONOUS_PUT_DATA ? DURABILITY_GROUP : DURABILITY_ASYNC)
+
+// the keys are switched when the mode changes, so that the hot path does not test the mode at all
+DECLARE_STATIC_KEY_FALSE(durability_sync_key);
+DECLARE_STATIC_KEY_FALSE(durability_group_key);
+
+extern unsigned int flush_interval_ms;
+
+int durability_mode_from_name(const char *name);
+enum durability_mode get_durability_mode(void);
+const char *durability_mode_name(enum durability_mode mode);
+int set_durability_mode(enum durability_mode mode);
+void set_flush_interval(unsigned int ms);
+int durability_start(struct bldms_dev *dev, int mode, unsigned int ms);
+int flush_whole_device(struct block_device *bdev);
+void durability_stop(struct bldms_dev *dev);
+
+
+/**
+ * @brief  Make a dirty buffer of the device durable according to the current mode. It must be called without
+ *         any spinlock held, since it can sleep.
+ */
+static inline int make_durable(struct bldms_dev *dev, struct buffer_head *bh){
+    if (static_branch_unlikely(&durability_group_key))
+        return commit_buffer(dev, bh);
+    if (static_branch_unlikely(&durability_sync_key))
+        return sync_dirty_buffer(bh);
+    // async and periodic modes: the buffer is written later
+    return 0;
+}
+
+
+/**
+ * @brief  Make several dirty buffers of the same device durable according to the current mode: in sync and group
+ *         modes, they are written with a single submission and a single flush of the device cache.
+ *         It must be called without any spinlock held, since it can sleep.
+ */
+static inline int make_durable_many(struct buffer_head **bhs, unsigned int n){
+    if (static_branch_unlikely(&durability_group_key) || static_branch_unlikely(&durability_sync_key))
+        return commit_buffers(bhs, n);
+    return 0;
+}
+
+#endif
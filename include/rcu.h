@@ -7,27 +7,63 @@
 #include <linux/list.h>
 #include <linux/rculist.h>
 #include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
 #include "device.h"
 
-extern struct list_head valid_blk_list;
-extern spinlock_t rcu_write_lock;
+// the list, the tree and the index of the valid blocks are kept in the struct bldms_dev of each device
+extern atomic_t nr_pending_reclaims;
 
 typedef struct _rcu_elem {
-    uint32_t ndx;
+    uint64_t ndx;
     ktime_t nsec;
     size_t valid_bytes;
     struct list_head node;
+    struct rb_node rb;                      // node of the (timestamp, index) ordered tree
+    struct rcu_head rcu;                    // used to free the element after a grace period
 } rcu_elem;
 
 
 #define rcu_next_elem(el) \
         list_entry_rcu((el)->node.next, rcu_elem, node)
 
+/*
+* Direct per-block index of the RCU list: the entry of a block points to its rcu_elem if the block is valid,
+* it is NULL otherwise. Readers must be inside an RCU read-side critical section, writers must hold the spinlock.
+* The entries are kept in pages of INDEX_PAGE_ENTRIES entries, allocated the first time a block of the page
+* becomes valid and kept until the unmount: only a directory with a pointer per page is allocated at mount time.
+*/
+#define INDEX_PAGE_SHIFT 9
+#define INDEX_PAGE_ENTRIES (1UL << INDEX_PAGE_SHIFT)        // 512 entries, i.e. a 4 KB page
+
+static inline rcu_elem __rcu **index_page_of(struct bldms_dev *dev, uint64_t ndx){
+    return READ_ONCE(dev->valid_blk_index[ndx >> INDEX_PAGE_SHIFT]);
+}
+
+static inline rcu_elem *lookup_valid_block(struct bldms_dev *dev, uint64_t ndx){
+    rcu_elem __rcu **page = index_page_of(dev, ndx);
+    return (page) ? rcu_dereference(page[ndx & (INDEX_PAGE_ENTRIES - 1)]) : NULL;
+}
+
+static inline rcu_elem *lookup_valid_block_secure(struct bldms_dev *dev, uint64_t ndx){
+    rcu_elem __rcu **page = index_page_of(dev, ndx);
+    return (page) ? rcu_dereference_protected(page[ndx & (INDEX_PAGE_ENTRIES - 1)], lockdep_is_held(&dev->rcu_write_lock)) : NULL;
+}
+
 /* functions*/
-extern int add_valid_block(uint32_t ndx, uint32_t valid_bytes, ktime_t nsec);
-extern void add_valid_block_secure(rcu_elem *el, uint32_t ndx, uint32_t valid_bytes, ktime_t nsec);
-extern void add_valid_block_in_order_secure(rcu_elem *el, uint32_t ndx, uint32_t valid_bytes, ktime_t nsec);
-extern int remove_valid_block(uint32_t ndx);
-extern void remove_all_entries_secure(void);
-extern inline void rcu_init(void);
+extern int add_valid_block(struct bldms_dev *dev, uint64_t ndx, uint32_t valid_bytes, ktime_t nsec);
+extern void add_valid_block_secure(struct bldms_dev *dev, rcu_elem *el, uint64_t ndx, uint32_t valid_bytes, ktime_t nsec);
+extern void add_valid_block_in_order_secure(struct bldms_dev *dev, rcu_elem *el, uint64_t ndx, uint32_t valid_bytes, ktime_t nsec);
+extern rcu_elem *find_valid_block_from(struct bldms_dev *dev, ktime_t nsec, uint64_t ndx);
+extern ktime_t next_timestamp_secure(struct bldms_dev *dev);
+extern void del_valid_block_secure(struct bldms_dev *dev, rcu_elem *el);
+extern void reclaim_valid_block(rcu_elem *el);
+extern int remove_valid_block(struct bldms_dev *dev, uint64_t ndx);
+extern void remove_all_entries(struct bldms_dev *dev);
+extern int valid_blk_index_init(struct bldms_dev *dev, size_t nblocks);
+extern int valid_blk_index_prepare(struct bldms_dev *dev, uint64_t ndx);
+extern size_t valid_blk_index_pages(struct bldms_dev *dev);
+extern void valid_blk_index_free(struct bldms_dev *dev);
+extern inline void rcu_init(struct bldms_dev *dev);
 #endif
\ No newline at end of file
@@ -0,0 +1,39 @@
+#pragma once
+#ifndef __BLDMS_SCAN_H__
+#define __BLDMS_SCAN_H__
+
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/wait.h>
+#include "device.h"
+
+/*
+* Lazy mount: the index of the valid blocks is built by a background worker, while the device is already mounted.
+* Until the scan completes, a block is known only once its header has been scanned, either by the worker
+* or on demand by a system call that targets it. The state of the scan is kept in the struct bldms_dev of the device.
+*/
+void lazy_scan_init(struct bldms_dev *dev);
+int lazy_scan_start(struct bldms_dev *dev);
+int lazy_scan_stop(struct bldms_dev *dev);
+int scan_block_on_demand(struct bldms_dev *dev, uint64_t ndx);
+
+// make sure that the header of the block "ndx" has been scanned, before looking the block up in the index
+static inline int ensure_scanned(struct bldms_dev *dev, uint64_t ndx){
+    if (likely(smp_load_acquire(&dev->scan_done)))
+        return 0;
+    return scan_block_on_demand(dev, ndx);
+}
+
+// the index holds the state of all the blocks: no scan was started, or the started one has scanned all of them
+static inline bool index_complete(struct bldms_dev *dev){
+    return smp_load_acquire(&dev->scan_done) && (!dev->scanned_map || READ_ONCE(dev->scan_ok));
+}
+
+// ordered reads need the whole index: they wait for the scan to complete
+static inline int wait_scan_complete(struct bldms_dev *dev){
+    if (likely(smp_load_acquire(&dev->scan_done)))
+        return 0;
+    return wait_event_interruptible(dev->scan_wq, smp_load_acquire(&dev->scan_done));
+}
+
+#endif
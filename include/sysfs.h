@@ -0,0 +1,11 @@
+#pragma once
+#ifndef __BLDMS_SYSFS_H__
+#define __BLDMS_SYSFS_H__
+
+// name of the directory of the module in /sys/fs
+#define BLDMS_SYSFS_DIR "bldms_fs"
+
+int bldms_sysfs_init(void);
+void bldms_sysfs_exit(void);
+
+#endif
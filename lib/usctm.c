@@ -52,13 +52,13 @@ module_param(sys_ni_syscall_address, ulong, 0660);
 
 
 #define MAX_FREE 15
-#define MAX_ACQUIRES 4
+#define MAX_ACQUIRES 8
 int free_entries[MAX_FREE];
 module_param_array(free_entries,int,NULL,0660);//default array size already known - here we expect to receive what entries are free
 int num_entries_found;
 module_param(num_entries_found, int, 0660);
 
-int restore[MAX_ACQUIRES] = {[0 ... (MAX_ACQUIRES-1)] -1};
+int restore[MAX_FREE] = {[0 ... (MAX_FREE-1)] -1};
 
 unsigned long cr0;
 
@@ -101,8 +101,8 @@ int get_entries(int *entry_ids, int *entry_ndx, int num_acquires, unsigned long
 		if (restore[i] == -1){
 			// the entry is free
 			restore[i] = free_entries[i];
-			ids[i] = free_entries[i];
-			indexes[i] = i;
+			ids[given] = free_entries[i];
+			indexes[given] = i;
 			given++;
 		}
 	}
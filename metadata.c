@@ -0,0 +1,366 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file metadata.c
+ * @brief access to the on-disk headers of the device blocks, for both the format versions:
+ * in version 1 the header of a block is at the beginning of the block itself, in version 2 it is an entry
+ * of the metadata table that follows the inode block, with 409 headers per table block.
+ * At mount time, the headers are read by several workers, each one scanning a range of blocks with large readahead windows
+ * and sorting the valid blocks of its range by timestamp; the sorted runs are then merged in a single pass.
+ * @author Andrea Pepe
+ * @date April 22, 2023  
+*/
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+
+#include "include/bldms.h"
+#include "include/device.h"
+#include "include/rcu.h"
+#include "include/scan.h"
+
+
+#define SCAN_READAHEAD_BLOCKS 256           // blocks submitted together, before waiting for the first of them
+#define SCAN_MAX_WORKERS 16
+#define SCAN_MIN_BLOCKS_PER_WORKER 1024     // below this, a range is not worth a worker of its own
+
+unsigned int scan_workers = 0;
+module_param(scan_workers, uint, 0644);
+MODULE_PARM_DESC(scan_workers, "Number of workers reading the headers of the blocks at mount time (0 = one per online CPU)");
+
+// range of device blocks scanned by a single worker at mount time
+struct scan_work {
+    struct work_struct work;
+    struct bldms_dev *dev;
+    sector_t first;                         // first device block of the range
+    sector_t last;                          // device block following the last one of the range
+    struct valid_desc *valid;               // valid blocks of the range, in (timestamp, index) order
+    size_t nr_valid;
+    size_t max_valid;                       // number of descriptors allocated in "valid"
+    int ret;
+};
+
+
+/**
+ * @brief  Index of the first block whose header is kept in the device block "blk": the headers of the blocks
+ *         from md_first_ndx(blk) to md_first_ndx(blk + 1), excluded, are kept in such device block.
+ */
+uint64_t md_first_ndx(struct bldms_dev *dev, sector_t blk){
+    if (dev->bldms_format == BLDMS_FORMAT_V1)
+        return blk - data_block_nr(dev, 0);
+    return min_t(uint64_t, (blk - NUM_METADATA_BLKS) * MD_ENTRIES_PER_BLOCK, dev->md_array_size);
+}
+
+
+/**
+ * @brief  (timestamp, index) order of two descriptors of valid blocks, as expected by sort().
+ */
+int valid_desc_cmp(const void *a, const void *b){
+    const struct valid_desc *x = a, *y = b;
+
+    if (x->md.nsec != y->md.nsec)
+        return (x->md.nsec < y->md.nsec) ? -1 : 1;
+    return (x->ndx < y->ndx) ? -1 : (x->ndx > y->ndx);
+}
+
+
+/*
+* Append a valid block to the descriptors of the worker. The number of valid blocks is not known in advance:
+* the array doubles when full, so that only the valid blocks take memory.
+*/
+static int push_valid(struct scan_work *sw, uint64_t ndx, const bldms_block *md){
+    struct valid_desc *larger;
+    size_t max;
+
+    if (sw->nr_valid == sw->max_valid){
+        max = (sw->max_valid) ? 2 * sw->max_valid : MD_ENTRIES_PER_BLOCK;
+        larger = kvmalloc_array(max, sizeof(struct valid_desc), GFP_KERNEL);
+        if (!larger)
+            return -ENOMEM;
+        if (sw->valid)
+            memcpy(larger, sw->valid, sw->nr_valid * sizeof(struct valid_desc));
+        kvfree(sw->valid);
+        sw->valid = larger;
+        sw->max_valid = max;
+    }
+    sw->valid[sw->nr_valid].ndx = ndx;
+    sw->valid[sw->nr_valid].md = *md;
+    sw->nr_valid++;
+    return 0;
+}
+
+
+/*
+* Collect the valid blocks among the headers kept in the device block "blk":
+* the whole block of the metadata table in version 2, the header at the beginning of the data block in version 1.
+*/
+static int collect_headers(struct scan_work *sw, sector_t blk, const char *data){
+    uint64_t ndx, last = md_first_ndx(sw->dev, blk + 1);
+    bldms_block md;
+    int ret;
+
+    for (ndx = md_first_ndx(sw->dev, blk); ndx < last; ndx++){
+        memcpy(&md, data + md_block_offset(sw->dev, ndx), METADATA_SIZE);
+        if (md.is_valid != BLK_VALID)
+            continue;
+        ret = push_valid(sw, ndx, &md);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief  Readahead of a sequential scan that is about to read the block "blk", with "ra" the first block whose read
+ *         has not been submitted yet: the reads of a whole window are submitted at once, in a plug so that the
+ *         requests of adjacent blocks are merged, and the window that follows is submitted before waiting for the
+ *         blocks of the current one. This way, the device always has a window of requests in flight.
+ */
+void scan_readahead(struct super_block *sb, sector_t blk, sector_t *ra, sector_t last){
+    struct blk_plug plug;
+
+    if (*ra >= last || blk + SCAN_READAHEAD_BLOCKS < *ra)
+        return;
+    blk_start_plug(&plug);
+    for (; *ra < last && *ra < blk + 2 * SCAN_READAHEAD_BLOCKS; (*ra)++)
+        sb_breadahead(sb, *ra);
+    blk_finish_plug(&plug);
+}
+
+
+/*
+* Scan the range of the worker, with a readahead window always in flight.
+* Each worker collects the valid blocks of its range in its own array and sorts them, without any synchronization.
+*/
+static void scan_range(struct work_struct *work){
+    struct scan_work *sw = container_of(work, struct scan_work, work);
+    struct super_block *sb = sw->dev->sb;
+    struct buffer_head *bh;
+    sector_t blk, ra = sw->first;
+
+    for (blk = sw->first; blk < sw->last; blk++){
+        scan_readahead(sb, blk, &ra, sw->last);
+        bh = sb_bread(sb, blk);
+        if (!bh){
+            sw->ret = -EIO;
+            return;
+        }
+        sw->ret = collect_headers(sw, blk, bh->b_data);
+        brelse(bh);
+        if (sw->ret < 0)
+            return;
+    }
+    sort(sw->valid, sw->nr_valid, sizeof(struct valid_desc), valid_desc_cmp, NULL);
+    sw->ret = 0;
+}
+
+
+/*
+* Merge the sorted runs of valid blocks of the workers in a single array, in (timestamp, index) order.
+* The number of runs is small, so the head with the smallest key is simply searched among all of them.
+*/
+static int merge_valid(struct scan_work *sw, unsigned int nr_workers, struct valid_desc **valid, size_t *nr_valid){
+    size_t *pos, n = 0, k;
+    unsigned int i, min;
+
+    for (i = 0; i < nr_workers; i++)
+        n += sw[i].nr_valid;
+    *valid = NULL;
+    *nr_valid = n;
+    if (!n)
+        return 0;
+
+    *valid = kvmalloc_array(n, sizeof(struct valid_desc), GFP_KERNEL);
+    pos = kcalloc(nr_workers, sizeof(size_t), GFP_KERNEL);
+    if (!*valid || !pos){
+        kvfree(*valid);
+        kfree(pos);
+        *valid = NULL;
+        return -ENOMEM;
+    }
+
+    for (k = 0; k < n; k++){
+        min = nr_workers;
+        for (i = 0; i < nr_workers; i++){
+            if (pos[i] == sw[i].nr_valid)
+                continue;
+            if (min == nr_workers || valid_desc_cmp(&sw[i].valid[pos[i]], &sw[min].valid[pos[min]]) < 0)
+                min = i;
+        }
+        (*valid)[k] = sw[min].valid[pos[min]++];
+    }
+    kfree(pos);
+    return 0;
+}
+
+
+/**
+ * @brief  Read the on-disk headers of all the blocks of the device and collect the valid ones:
+ *         one table block every 409 blocks in version 2, every block of the device in version 1.
+ *         The blocks to be read are split in contiguous ranges, scanned in parallel by unbound workers;
+ *         each worker collects and sorts the valid blocks of its range, so that only the merge of the sorted runs
+ *         is left to the caller thread. Only the valid blocks take memory, whatever the size of the device.
+ * @param  valid: filled with the valid blocks in (timestamp, index) order, to be freed with kvfree()
+ * @param  nr_valid: filled with the number of valid blocks
+ * @retval 0 if ok, -EIO if a block can not be read, -ENOMEM
+ */
+int load_metadata(struct bldms_dev *dev, struct valid_desc **valid, size_t *nr_valid){
+    struct scan_work *sw;
+    ktime_t start = ktime_get();
+    sector_t first, nr_blocks, per_worker;
+    unsigned int i, nr_workers;
+    int ret = 0;
+
+    *valid = NULL;
+    *nr_valid = 0;
+    first = (dev->bldms_format == BLDMS_FORMAT_V1) ? data_block_nr(dev, 0) : NUM_METADATA_BLKS;
+    nr_blocks = (dev->bldms_format == BLDMS_FORMAT_V1) ? dev->md_array_size : MD_TABLE_BLOCKS(dev->md_array_size);
+    if (!nr_blocks)
+        return 0;
+
+    nr_workers = (scan_workers) ? scan_workers : num_online_cpus();
+    nr_workers = min_t(unsigned int, nr_workers, SCAN_MAX_WORKERS);
+    nr_workers = min_t(sector_t, nr_workers, DIV_ROUND_UP(nr_blocks, SCAN_MIN_BLOCKS_PER_WORKER));
+    per_worker = DIV_ROUND_UP(nr_blocks, nr_workers);
+
+    sw = kcalloc(nr_workers, sizeof(struct scan_work), GFP_KERNEL);
+    if (!sw)
+        return -ENOMEM;
+
+    for (i = 0; i < nr_workers; i++){
+        sw[i].dev = dev;
+        sw[i].first = first + i * per_worker;
+        sw[i].last = first + min_t(sector_t, (i + 1) * per_worker, nr_blocks);
+        INIT_WORK(&sw[i].work, scan_range);
+        // the last range is scanned by the mounting thread itself
+        if (i < nr_workers - 1)
+            queue_work(system_unbound_wq, &sw[i].work);
+    }
+    scan_range(&sw[nr_workers - 1].work);
+
+    for (i = 0; i < nr_workers; i++){
+        if (i < nr_workers - 1)
+            flush_work(&sw[i].work);
+        if (sw[i].ret < 0)
+            ret = sw[i].ret;
+    }
+    if (ret == 0)
+        ret = merge_valid(sw, nr_workers, valid, nr_valid);
+
+    for (i = 0; i < nr_workers; i++)
+        kvfree(sw[i].valid);
+    kfree(sw);
+
+    printk("%s: headers of %llu blocks read by %u workers in %lld us, %lu valid blocks\n", MOD_NAME,
+            (unsigned long long)nr_blocks, nr_workers, ktime_us_delta(ktime_get(), start), *nr_valid);
+    return ret;
+}
+
+
+/**
+ * @brief  Read the device block that keeps the header of the block of index "ndx".
+ * @retval The buffer head of the block, NULL on error
+ */
+struct buffer_head *read_metadata_block(struct bldms_dev *dev, uint64_t ndx){
+    return sb_bread(dev->sb, md_block_nr(dev, ndx));
+}
+
+
+/**
+ * @brief  Get the block of the metadata table that keeps the header of the block of index "ndx", to rewrite it
+ *         through update_metadata(), without reading it from the device: if it is not cached, its content is rebuilt
+ *         from the index, which holds the state of all the blocks (the free blocks get an empty header).
+ *         The block is read from the device if the index is not complete yet, i.e. during a lazy scan,
+ *         or if the device has no metadata table.
+ * @retval The buffer head of the block, NULL on error
+ */
+struct buffer_head *get_metadata_block(struct bldms_dev *dev, uint64_t ndx){
+    struct buffer_head *bh;
+    sector_t blk = md_block_nr(dev, ndx);
+    uint64_t i, last;
+    bldms_block md;
+    rcu_elem *el;
+
+    if (!has_md_table(dev) || !index_complete(dev))
+        return read_metadata_block(dev, ndx);
+
+    bh = sb_getblk(dev->sb, blk);
+    if (!bh || buffer_uptodate(bh))
+        return bh;
+
+    // the buffer lock serializes the rebuild with the readers of the block and with update_metadata()
+    lock_buffer(bh);
+    if (!buffer_uptodate(bh)){
+        memset(bh->b_data, 0, DEFAULT_BLOCK_SIZE);
+        last = md_first_ndx(dev, blk + 1);
+        rcu_read_lock();
+        for (i = md_first_ndx(dev, blk); i < last; i++){
+            el = lookup_valid_block(dev, i);
+            if (!el)
+                continue;
+            md.nsec = el->nsec;
+            md.valid_bytes = el->valid_bytes;
+            md.is_valid = BLK_VALID;
+            memcpy(bh->b_data + md_block_offset(dev, i), &md, METADATA_SIZE);
+        }
+        rcu_read_unlock();
+        set_buffer_uptodate(bh);
+    }
+    unlock_buffer(bh);
+    return bh;
+}
+
+
+/**
+ * @brief  Write the on-disk header of the block "ndx", kept by the passed buffer, according to the current state of
+ *         the block in the index, and mark the buffer as dirty: a block found in the index gets its timestamp and size,
+ *         otherwise only its validity bit is cleared. The buffer is locked while the index is looked up, so
+ *         concurrent updates of headers in the same block are serialized: since each writer changes the index before
+ *         updating the header, the last one to update it writes the latest state of the block.
+ */
+void update_metadata(struct bldms_dev *dev, struct buffer_head *bh, uint64_t ndx){
+    bldms_block md;
+    rcu_elem *el;
+
+    lock_buffer(bh);
+    memcpy(&md, bh->b_data + md_block_offset(dev, ndx), METADATA_SIZE);
+
+    rcu_read_lock();
+    el = lookup_valid_block(dev, ndx);
+    if (el){
+        md.nsec = el->nsec;
+        md.valid_bytes = el->valid_bytes;
+        md.is_valid = BLK_VALID;
+    }else{
+        md.is_valid = BLK_INVALID;
+    }
+    rcu_read_unlock();
+
+    memcpy(bh->b_data + md_block_offset(dev, ndx), &md, METADATA_SIZE);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+}
@@ -17,16 +17,104 @@
  * @file rcu.c - rcu list management for BLDMS service
  * @brief functions for RCU list management - some of them internally perform lock operations
  * on the writing spinlock, others expect the spinlock management to be done outside.
+ * The list is paired with a red-black tree ordered by (timestamp, index), used to find insertion points
+ * and successors in logarithmic time; readers walk the tree locklessly, validated by a sequence counter.
  * @author Andrea Pepe
  * @date April 22, 2023  
 */
 
 #include "include/rcu.h"
+#include "include/cache.h"
 #include <linux/slab.h>
+#include <linux/mm.h>
 
 
-LIST_HEAD(valid_blk_list);                  // RCU-list of currently valid blocks of the block device
-spinlock_t rcu_write_lock;                  // spinlock used for write operations on the RCU-list, in order to synchronize concurrent writers
+atomic_t nr_pending_reclaims;               // number of removed elements still waiting for their grace period, on all the devices
+
+
+/**
+ * @brief  Compare the (timestamp, index) key of an element with the passed one.
+ * @retval less than 0, 0 or greater than 0 if the key of "el" is respectively smaller, equal or bigger
+ */
+static inline int rcu_elem_cmp(const rcu_elem *el, ktime_t nsec, uint64_t ndx){
+    if (el->nsec != nsec)
+        return (el->nsec < nsec) ? -1 : 1;
+    if (el->ndx != ndx)
+        return (el->ndx < ndx) ? -1 : 1;
+    return 0;
+}
+
+
+/*
+* Publish an element in the per-block index: the page of the entry must have been allocated
+* by valid_blk_index_prepare(). The writing spinlock must be held.
+*/
+static inline void index_set_secure(struct bldms_dev *dev, uint64_t ndx, rcu_elem *el){
+    rcu_assign_pointer(index_page_of(dev, ndx)[ndx & (INDEX_PAGE_ENTRIES - 1)], el);
+}
+
+
+/**
+ * @brief  Link an element in the ordered tree, in O(log n). The writing spinlock must be held.
+ * @retval The element that precedes the new one in (timestamp, index) order, NULL if it is the first one.
+ */
+static rcu_elem *tree_insert_secure(struct bldms_dev *dev, rcu_elem *el){
+    struct rb_node **link = &dev->valid_blk_tree.rb_node, *parent = NULL;
+    rcu_elem *curr, *prev = NULL;
+
+    while (*link){
+        parent = *link;
+        curr = rb_entry(parent, rcu_elem, rb);
+        if (rcu_elem_cmp(curr, el->nsec, el->ndx) > 0){
+            link = &parent->rb_left;
+        }else{
+            prev = curr;
+            link = &parent->rb_right;
+        }
+    }
+
+    write_seqcount_begin(&dev->valid_blk_seq);
+    rb_link_node_rcu(&el->rb, parent, link);
+    rb_insert_color(&el->rb, &dev->valid_blk_tree);
+    write_seqcount_end(&dev->valid_blk_seq);
+    return prev;
+}
+
+
+/**
+ * @brief  Link an element with the biggest key in the ordered tree, as the right child of the current
+ *         last element (i.e. the tail of the RCU list), without descending the tree. The writing spinlock must be held.
+ */
+static void tree_append_secure(struct bldms_dev *dev, rcu_elem *el){
+    struct rb_node **link = &dev->valid_blk_tree.rb_node, *parent = NULL;
+
+    if (!list_empty(&dev->valid_blk_list)){
+        parent = &(list_last_entry(&dev->valid_blk_list, rcu_elem, node)->rb);
+        link = &parent->rb_right;
+    }
+
+    write_seqcount_begin(&dev->valid_blk_seq);
+    rb_link_node_rcu(&el->rb, parent, link);
+    rb_insert_color(&el->rb, &dev->valid_blk_tree);
+    write_seqcount_end(&dev->valid_blk_seq);
+}
+
+
+/**
+ * @brief  Assign the timestamp of a new message. It must be called with the writing spinlock held:
+ *         the wall-clock time is used, unless it is not bigger than the last assigned timestamp (e.g. two
+ *         messages in the same nanosecond on different CPUs, or a clock step back); in such a case the
+ *         last timestamp plus one nanosecond is used. Timestamps are therefore unique and follow the order of
+ *         the insertions in the RCU list, so that a new element can always be appended to its tail.
+ */
+ktime_t next_timestamp_secure(struct bldms_dev *dev){
+    ktime_t now = ktime_get_real();
+
+    if (now <= dev->last_timestamp)
+        now = dev->last_timestamp + 1;
+    dev->last_timestamp = now;
+    return now;
+}
 
 
 
@@ -35,34 +123,43 @@ spinlock_t rcu_write_lock;                  // spinlock used for write operation
  *         RCU locks are taken inside the function.
  * @retval less than 0 if error, 0 if ok
  */
-int add_valid_block(uint32_t ndx, uint32_t valid_bytes, ktime_t nsec){
+int add_valid_block(struct bldms_dev *dev, uint64_t ndx, uint32_t valid_bytes, ktime_t nsec){
     rcu_elem *el;
-    el = kzalloc(sizeof(rcu_elem), GFP_ATOMIC);
-    if (!el)
+    el = rcu_elem_alloc(GFP_KERNEL);
+    if (!el || valid_blk_index_prepare(dev, ndx) < 0){
+        if (el)
+            rcu_elem_free(el);
         return -ENOMEM;
+    }
 
     el->ndx = ndx;
     el->valid_bytes = valid_bytes;
     el->nsec = nsec;
 
-    spin_lock(&rcu_write_lock);
-    list_add_tail_rcu(&el->node, &valid_blk_list);
-    spin_unlock(&rcu_write_lock);
+    spin_lock(&dev->rcu_write_lock);
+    tree_append_secure(dev, el);
+    list_add_tail_rcu(&el->node, &dev->valid_blk_list);
+    index_set_secure(dev, ndx, el);
+    spin_unlock(&dev->rcu_write_lock);
     return 0;    
 }
 
 /**
- * @brief  This function must be invoked only with a read lock signaled before;
- *         such read lock should be released after the function returns.
+ * @brief  This function must be invoked only with the writing spinlock taken before;
+ *         such lock should be released after the function returns.
  *         The function expects a pointer to a dynamically allocated 
- *         rcu element structure to fill and insert in the list.  
+ *         rcu element structure to fill and append, in O(1), to the tail of the list: the key of the
+ *         new element must be the biggest one, e.g. a timestamp given by next_timestamp_secure().
+ *         The page of the per-block index of the block must have been allocated by valid_blk_index_prepare().
  */
-void inline add_valid_block_secure(rcu_elem *el, uint32_t ndx, uint32_t valid_bytes, ktime_t nsec){
+void inline add_valid_block_secure(struct bldms_dev *dev, rcu_elem *el, uint64_t ndx, uint32_t valid_bytes, ktime_t nsec){
     el->ndx = ndx;
     el->valid_bytes = valid_bytes;
     el->nsec = nsec;
 
-    list_add_tail_rcu(&el->node, &valid_blk_list);
+    tree_append_secure(dev, el);
+    list_add_tail_rcu(&el->node, &dev->valid_blk_list);
+    index_set_secure(dev, ndx, el);
     return;    
 }
 
@@ -70,85 +167,229 @@ void inline add_valid_block_secure(rcu_elem *el, uint32_t ndx, uint32_t valid_by
  * @brief  This function expects the lock on the write operations' spinlock to be taken before
  *         the function is actually called. Moreover, the parameter "el" should point to a dynamically allocated
  *         memory area, larger enough to host an rcu_elem struct. The rcu_elem will be filled with the passed argmuents
- *         and added to the RCU-list through a timestamp-wise in-order insertion.
+ *         and added to the RCU-list through a timestamp-wise in-order insertion: the insertion point is
+ *         found through the ordered tree, in O(log n), whatever the order of the insertions is.
+ *         The page of the per-block index of the block must have been allocated by valid_blk_index_prepare().
  */
-void inline add_valid_block_in_order_secure(rcu_elem *el, uint32_t ndx, uint32_t valid_bytes, ktime_t nsec){
+void inline add_valid_block_in_order_secure(struct bldms_dev *dev, rcu_elem *el, uint64_t ndx, uint32_t valid_bytes, ktime_t nsec){
     rcu_elem *prev;
     el->ndx = ndx;
     el->valid_bytes = valid_bytes;
     el->nsec = nsec;
 
-    if (list_empty(&valid_blk_list)){
-        // the list is empty: just insert the node
-        list_add_tail_rcu(&(el->node), &valid_blk_list);
-        return;
+    prev = tree_insert_secure(dev, el);
+    if (prev){
+        // insert the new node after the last one with a smaller (timestamp, index) key
+        list_add_rcu(&(el->node), &(prev->node));
+    }else{
+        // if no node with a smaller key is found, insert at the beginning of the list
+        list_add_rcu(&(el->node), &dev->valid_blk_list);
     }
 
-    list_for_each_entry_reverse(prev, &valid_blk_list, node){
-        if (prev->nsec < el->nsec){
-            // this is the first node to have a timestamp lower than the new node
-            // insert the new node after this one
-            list_add_rcu(&(el->node), &(prev->node));
-            return;
-        }
-    }
-    // if no node with a smaller timestamp is found, insert at the beginning of the list
-    list_add_rcu(&(el->node), &valid_blk_list);
+    // the element is published in the per-block index only once it is linked in the list
+    index_set_secure(dev, ndx, el);
     return;    
 }
 
 
+/**
+ * @brief  Find the first valid block whose (timestamp, index) key is not smaller than the passed one, in O(log n).
+ *         It must be invoked inside an RCU read-side critical section, without the need of the writing spinlock:
+ *         a lookup that overlaps with a rebalancing of the tree is simply repeated.
+ * @retval The element found, NULL if there is no such valid block.
+ */
+rcu_elem *find_valid_block_from(struct bldms_dev *dev, ktime_t nsec, uint64_t ndx){
+    struct rb_node *node;
+    rcu_elem *curr, *found;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->valid_blk_seq);
+        found = NULL;
+        node = rcu_dereference_raw(dev->valid_blk_tree.rb_node);
+        while (node){
+            curr = rb_entry(node, rcu_elem, rb);
+            if (rcu_elem_cmp(curr, nsec, ndx) >= 0){
+                found = curr;
+                node = rcu_dereference_raw(node->rb_left);
+            }else{
+                node = rcu_dereference_raw(node->rb_right);
+            }
+        }
+    } while (read_seqcount_retry(&dev->valid_blk_seq, seq));
+
+    return found;
+}
+
+
+/**
+ * @brief  Unlink an element from both the RCU list and the per-block index.
+ *         The writing spinlock must be held by the caller; the element can be freed
+ *         only after a grace period.
+ */
+void del_valid_block_secure(struct bldms_dev *dev, rcu_elem *el){
+    RCU_INIT_POINTER(index_page_of(dev, el->ndx)[el->ndx & (INDEX_PAGE_ENTRIES - 1)], NULL);
+    write_seqcount_begin(&dev->valid_blk_seq);
+    rb_erase(&el->rb, &dev->valid_blk_tree);
+    write_seqcount_end(&dev->valid_blk_seq);
+    list_del_rcu(&el->node);
+}
+
+
+static void rcu_elem_free_cb(struct rcu_head *head){
+    rcu_elem_free(container_of(head, rcu_elem, rcu));
+    atomic_dec(&nr_pending_reclaims);
+}
+
+
+/**
+ * @brief  Free an element already unlinked by del_valid_block_secure(), once the current grace period ends.
+ *         The function does not wait: the element is freed by an RCU callback, so it can be called from
+ *         any context, also with the writing spinlock held.
+ */
+void reclaim_valid_block(rcu_elem *el){
+    atomic_inc(&nr_pending_reclaims);
+    call_rcu(&el->rcu, rcu_elem_free_cb);
+}
+
+
 /**
  * @brief  Remove the node of the list with index equal to "ndx", if any. Spinlock is managed
  *         inside the function.
  */
-int remove_valid_block(uint32_t ndx){
+int remove_valid_block(struct bldms_dev *dev, uint64_t ndx){
     rcu_elem *el;
 
     // write lock to find the element to be removed and remove it
-    spin_lock(&rcu_write_lock);
-    list_for_each_entry(el, &valid_blk_list, node){
-        if (el->ndx == ndx){
-            // this is the element to be removed
-            list_del_rcu(&el->node);
-
-            spin_unlock(&rcu_write_lock);
-
-            // wait for the grace period and then free the removed element
-            synchronize_rcu();
-            kfree(el);
-            return 0;
-        }
+    spin_lock(&dev->rcu_write_lock);
+    el = lookup_valid_block_secure(dev, ndx);
+    if (!el){
+        spin_unlock(&dev->rcu_write_lock);
+        return -ENODATA;
     }
 
-    spin_unlock(&rcu_write_lock);
-    return -ENODATA;
+    // this is the element to be removed
+    del_valid_block_secure(dev, el);
+    spin_unlock(&dev->rcu_write_lock);
+
+    // the removed element is freed after the grace period, without waiting for it
+    reclaim_valid_block(el);
+    return 0;
 }
 
 
 /**
-* @brief  This function removes all the entries from the rcu list;
-*         it is expected to be called only after having locked a writing spinlock before.
-*         The spinlock should be released after this function returned.
+* @brief  This function removes all the entries from the rcu list. The whole list, the tree and the per-block index
+*         are detached at once under the writing spinlock, which is managed inside the function; then a single
+*         grace period is waited for, without holding the spinlock, and all the elements are freed in bulk.
+*         The cost of the wait does not depend on the number of valid blocks.
 */
-void remove_all_entries_secure(void){
-    rcu_elem *el;
+void remove_all_entries(struct bldms_dev *dev){
+    LIST_HEAD(detached);
+    struct list_head *first, *last;
+    rcu_elem *el, *tmp;
+
+    spin_lock(&dev->rcu_write_lock);
+    if (list_empty(&dev->valid_blk_list)){
+        spin_unlock(&dev->rcu_write_lock);
+        goto wait_callbacks;
+    }
+
+    first = dev->valid_blk_list.next;
+    last = dev->valid_blk_list.prev;
+
+    // new readers find an empty list and an empty tree; readers already walking the list still end on its head
+    INIT_LIST_HEAD_RCU(&dev->valid_blk_list);
+    write_seqcount_begin(&dev->valid_blk_seq);
+    dev->valid_blk_tree = RB_ROOT;
+    write_seqcount_end(&dev->valid_blk_seq);
+    spin_unlock(&dev->rcu_write_lock);
 
-    // write lock should be taken outside
-    list_for_each_entry(el, &valid_blk_list, node){
-        // this is the element to be removed
-        list_del_rcu(&el->node);
+    synchronize_rcu();
 
-        // wait for the grace period and then free the removed element
-        synchronize_rcu();
-        kfree(el);
+    // no reader can reach the detached elements anymore: link them to a private list head to free them
+    first->prev = &detached;
+    last->next = &detached;
+    detached.next = first;
+    detached.prev = last;
+    list_for_each_entry_safe(el, tmp, &detached, node){
+        rcu_elem_free(el);
     }
+
+wait_callbacks:
+    // elements removed before by invalidate_data() may still wait for their callback
+    rcu_barrier();
+}
+
+
+/**
+* @brief   Allocate the directory of the per-block index, with an empty entry for each page of the index:
+*          it costs 8 bytes every 512 blocks of the device. Big devices get a virtually contiguous area.
+*/
+int valid_blk_index_init(struct bldms_dev *dev, size_t nblocks){
+    dev->nr_index_dir = DIV_ROUND_UP(nblocks, INDEX_PAGE_ENTRIES);
+    dev->valid_blk_index = kvzalloc(sizeof(rcu_elem __rcu **) * dev->nr_index_dir, GFP_KERNEL);
+    if (!dev->valid_blk_index)
+        return -ENOMEM;
+    atomic_long_set(&dev->nr_index_pages, 0);
+    return 0;
+}
+
+
+/**
+* @brief   Make sure that the page of the per-block index keeping the entry of the block "ndx" is allocated.
+*          It must be invoked before the block is published in the index, without the writing spinlock:
+*          concurrent writers may allocate the same page, but only the first one installs it.
+* @retval  0 if ok, -ENOMEM
+*/
+int valid_blk_index_prepare(struct bldms_dev *dev, uint64_t ndx){
+    rcu_elem __rcu **page;
+
+    if (likely(index_page_of(dev, ndx)))
+        return 0;
+
+    page = kzalloc(sizeof(rcu_elem __rcu *) * INDEX_PAGE_ENTRIES, GFP_KERNEL);
+    if (!page)
+        return -ENOMEM;
+    if (cmpxchg(&dev->valid_blk_index[ndx >> INDEX_PAGE_SHIFT], NULL, page) != NULL)
+        kfree(page);
+    else
+        atomic_long_inc(&dev->nr_index_pages);
+    return 0;
+}
+
+
+/**
+* @brief   Number of pages of the per-block index currently allocated.
+*/
+size_t valid_blk_index_pages(struct bldms_dev *dev){
+    return atomic_long_read(&dev->nr_index_pages);
+}
+
+
+/**
+* @brief   Release the per-block index; the RCU list is expected to be already empty.
+*/
+void valid_blk_index_free(struct bldms_dev *dev){
+    size_t i;
+
+    if (!dev->valid_blk_index)
+        return;
+    for (i = 0; i < dev->nr_index_dir; i++)
+        kfree(dev->valid_blk_index[i]);
+    kvfree(dev->valid_blk_index);
+    dev->valid_blk_index = NULL;
+    dev->nr_index_dir = 0;
 }
 
 
 /**
-* @brief   Initialize the writing spinlock associated with the RCU list
+* @brief   Initialize the empty RCU list of a device, with its writing spinlock
 */
-inline void rcu_init(void){
-    spin_lock_init(&rcu_write_lock);
+inline void rcu_init(struct bldms_dev *dev){
+    INIT_LIST_HEAD(&dev->valid_blk_list);
+    spin_lock_init(&dev->rcu_write_lock);
+    seqcount_init(&dev->valid_blk_seq);
+    dev->valid_blk_tree = RB_ROOT;
+    dev->last_timestamp = 0;
 }
\ No newline at end of file
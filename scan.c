@@ -0,0 +1,209 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file scan.c
+ * @brief lazy mount of the device. The mount returns as soon as the superblock and the inode are checked, with all the
+ * blocks marked as used in the free-space bitmap, and an unbound worker scans the headers of the blocks in the
+ * background: each valid block is inserted in order in the index, each free block is released to the allocator.
+ * The blocks targeted by system calls before the worker gets to them are scanned on demand, a whole device block
+ * of headers at a time; a bitmap records the scanned blocks, so that each of them is scanned only once.
+ * @author Andrea Pepe
+ * @date April 22, 2023
+*/
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+
+#include "include/bldms.h"
+#include "include/device.h"
+#include "include/rcu.h"
+#include "include/alloc.h"
+#include "include/cache.h"
+#include "include/scan.h"
+
+
+/*
+* Publish a scanned header: a valid block is inserted in order in the index, and the clock is moved past its
+* timestamp, so that new messages are still appended to the tail of the list; a free block is released to the
+* allocator. The scan mutex must be held.
+*/
+static int scan_entry(struct bldms_dev *dev, uint64_t ndx, const char *header){
+    bldms_block md;
+    rcu_elem *el;
+
+    memcpy(&md, header, METADATA_SIZE);
+    if (md.is_valid == BLK_VALID){
+        el = rcu_elem_alloc(GFP_KERNEL);
+        if (!el)
+            return -ENOMEM;
+        if (valid_blk_index_prepare(dev, ndx) < 0){
+            rcu_elem_free(el);
+            return -ENOMEM;
+        }
+        spin_lock(&dev->rcu_write_lock);
+        if (md.nsec > dev->last_timestamp)
+            dev->last_timestamp = md.nsec;
+        add_valid_block_in_order_secure(dev, el, ndx, md.valid_bytes, md.nsec);
+        spin_unlock(&dev->rcu_write_lock);
+    }else{
+        release_block(dev, ndx);
+    }
+    set_bit(ndx, dev->scanned_map);
+    return 0;
+}
+
+
+// scan the headers kept in the device block "blk", skipping the blocks already scanned
+static int scan_md_block(struct bldms_dev *dev, sector_t blk, struct buffer_head *bh){
+    uint64_t ndx, last = md_first_ndx(dev, blk + 1);
+    int ret;
+
+    for (ndx = md_first_ndx(dev, blk); ndx < last; ndx++){
+        if (test_bit(ndx, dev->scanned_map))
+            continue;
+        ret = scan_entry(dev, ndx, bh->b_data + md_block_offset(dev, ndx));
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+
+static void lazy_scan(struct work_struct *work){
+    struct bldms_dev *dev = container_of(work, struct bldms_dev, scan_work);
+    struct buffer_head *bh;
+    sector_t first, last, blk, ra;
+    ktime_t start = ktime_get();
+    int ret = 0;
+
+    first = (dev->bldms_format == BLDMS_FORMAT_V1) ? data_block_nr(dev, 0) : NUM_METADATA_BLKS;
+    last = first + ((dev->bldms_format == BLDMS_FORMAT_V1) ? dev->md_array_size : MD_TABLE_BLOCKS(dev->md_array_size));
+
+    for (blk = ra = first; blk < last; blk++){
+        if (READ_ONCE(dev->scan_abort))
+            return;
+
+        scan_readahead(dev->sb, blk, &ra, last);
+        bh = sb_bread(dev->sb, blk);
+        if (!bh){
+            ret = -EIO;
+            break;
+        }
+        mutex_lock(&dev->scan_mutex);
+        ret = scan_md_block(dev, blk, bh);
+        mutex_unlock(&dev->scan_mutex);
+        brelse(bh);
+        if (ret < 0)
+            break;
+        cond_resched();
+    }
+
+    if (ret < 0){
+        // the blocks not scanned stay used and out of the index, until the next mount
+        printk("%s: background scan of device %d failed with error %d - some blocks are unavailable\n", MOD_NAME,
+                dev->id, ret);
+    }else{
+        dev->scan_ok = 1;
+        printk("%s: background scan of %lu blocks of device %d completed in %lld us\n", MOD_NAME, dev->md_array_size,
+                dev->id, ktime_us_delta(ktime_get(), start));
+    }
+    smp_store_release(&dev->scan_done, 1);
+    wake_up_all(&dev->scan_wq);
+}
+
+
+/**
+ * @brief  Initialize the state of the scan of a device that is being mounted: no scan is in progress.
+ */
+void lazy_scan_init(struct bldms_dev *dev){
+    dev->scan_done = 1;
+    init_waitqueue_head(&dev->scan_wq);
+    mutex_init(&dev->scan_mutex);
+    dev->scanned_map = NULL;
+}
+
+
+/**
+ * @brief  Start the background scan of the device. All the blocks must be already marked as used in the bitmap.
+ * @retval 0 if ok, -ENOMEM
+ */
+int lazy_scan_start(struct bldms_dev *dev){
+    dev->scanned_map = kvzalloc(BITS_TO_LONGS(dev->md_array_size) * sizeof(unsigned long), GFP_KERNEL);
+    if (!dev->scanned_map)
+        return -ENOMEM;
+
+    dev->scan_abort = 0;
+    dev->scan_ok = 0;
+    smp_store_release(&dev->scan_done, 0);
+    INIT_WORK(&dev->scan_work, lazy_scan);
+    queue_work(system_unbound_wq, &dev->scan_work);
+    return 0;
+}
+
+
+/**
+ * @brief  Stop the background scan, if any, and free its structures.
+ * @retval 1 if the index is complete (no scan was started, or it scanned all the blocks), 0 otherwise
+ */
+int lazy_scan_stop(struct bldms_dev *dev){
+    int complete;
+
+    if (!dev->scanned_map)
+        return 1;
+
+    WRITE_ONCE(dev->scan_abort, 1);
+    cancel_work_sync(&dev->scan_work);
+    complete = dev->scan_ok;
+
+    kvfree(dev->scanned_map);
+    dev->scanned_map = NULL;
+    smp_store_release(&dev->scan_done, 1);
+    wake_up_all(&dev->scan_wq);
+    return complete;
+}
+
+
+/**
+ * @brief  Scan the header of the block "ndx", if the background scan has not done it yet, together with
+ *         the other headers kept in the same device block.
+ * @retval 0 if ok, -EIO if the header can not be read, -ENOMEM
+ */
+int scan_block_on_demand(struct bldms_dev *dev, uint64_t ndx){
+    struct buffer_head *bh;
+    int ret = 0;
+
+    mutex_lock(&dev->scan_mutex);
+    if (smp_load_acquire(&dev->scan_done) || test_bit(ndx, dev->scanned_map))
+        goto out;
+
+    bh = read_metadata_block(dev, ndx);
+    if (!bh){
+        ret = -EIO;
+        goto out;
+    }
+    ret = scan_md_block(dev, md_block_nr(dev, ndx), bh);
+    brelse(bh);
+out:
+    mutex_unlock(&dev->scan_mutex);
+    return ret;
+}
@@ -28,352 +28,815 @@
 #include <linux/syscalls.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/sort.h>
 
 #include "lib/include/usctm.h"  
 #include "include/bldms.h"
+#include "include/device.h"
 #include "include/rcu.h"
+#include "include/alloc.h"
+#include "include/cache.h"
+#include "include/durability.h"
+#include "include/scan.h"
 #include "include/syscalls.h"
 
 unsigned long the_syscall_table = 0x0;
 
 unsigned long the_ni_syscall;
 
-unsigned long new_sys_call_array[] = {0x0, 0x0, 0x0};
+unsigned long new_sys_call_array[] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
 #define HACKED_ENTRIES (int)(sizeof(new_sys_call_array)/sizeof(unsigned long))
 int restore_entries[HACKED_ENTRIES] = {[0 ... (HACKED_ENTRIES-1)] -1};
 int indexes[HACKED_ENTRIES] = {[0 ... (HACKED_ENTRIES-1)] -1};
 
+/*
+* Undo the WRITE PHASE of a message on the buffer of its reserved block, on failure.
+* copy_from_user() may have already overwritten part of the message area, while the header is untouched, so the
+* block is still free on the device. A clean buffer is marked as not up to date, so that its content is read again
+* from the device on the next access; a dirty one is kept up to date, since it holds a header not yet written back
+* (e.g. the one of an invalidation) that a read would discard: its message area is meaningless for a free block, and
+* the next put_data() on the block rewrites it entirely anyway.
+*/
+static void discard_write(struct buffer_head *bh){
+    if (!buffer_dirty(bh))
+        clear_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    brelse(bh);
+}
+
 /**
- * @brief  put_data() system call - add a message in a free block of the BLDMS device
+ * @brief  Add a message in a free block of the device: body of the put_data() system calls.
+ *         The caller must hold a reference to the device, taken through bldms_dev_get().
  * @retval The index of the block where the message has been put. Negative number on error;
  * if errno is ENOMEM, it means that there are not free blocks where to write.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
-__SYSCALL_DEFINEx(2, _put_data, char *, source, size_t, size){
-#else
-asmlinkage int sys_put_data(char *source, size_t size){
-#endif  
-    int i, ret, curr_blk;
+static long do_put_data(struct bldms_dev *dev, char *source, size_t size){
+    int ret;
     unsigned long copied;
-    int target_block;
-    struct super_block *sb;
-    struct buffer_head *bh;
-    bldms_block *old_metadata, *new_metadata;
-    char *buffer;
+    long target_block;
+    struct super_block *sb = dev->sb;
+    struct buffer_head *bh, *md_bh = NULL;
+    bldms_block new_metadata;
     rcu_elem *new_elem; 
 
-    // if the device is not mounted, return the ENODEV error
-    if(!bldms_mounted)
-        return -ENODEV;
-
     if(size > DEFAULT_BLOCK_SIZE - METADATA_SIZE){
         // the message is too big and can not be kept in a single block
         return -E2BIG;
     }
 
-    // get a reference to the superblock
-    sb = the_dev_superblock;
-    if(!sb){
-        return -EINVAL;
+    /*
+    * Make all the required allocations before the critical section, in order to make it
+    * the shortest as possible; furthermore, this reduces the presence of eventual blocking calls in the CS.
+    */
+    new_elem = rcu_elem_alloc(GFP_KERNEL);
+    if(!new_elem){
+        return -EADDRNOTAVAIL;
     }
 
-    buffer = kzalloc(DEFAULT_BLOCK_SIZE, GFP_ATOMIC);
-    if(!buffer){
-        return -EADDRNOTAVAIL;
+    new_metadata.valid_bytes = size;
+    new_metadata.is_valid = BLK_VALID;
+
+    /*
+    * RESERVE PHASE
+    * The free block to perform the valid operation is reserved out of the critical section:
+    * it is taken from the pool of free blocks of the current CPU, refilled in batches from the free-space bitmap
+    * in a circular buffer manner. No other writer can choose the same block.
+    */
+    target_block = alloc_free_block(dev);
+    if (target_block < 0){
+        // no available free blocks
+        rcu_elem_free(new_elem);
+        return -ENOMEM;
     }
 
-    // copy the message from user space in an intermediate kernel-level buffer
-    copied = copy_from_user(buffer + METADATA_SIZE, source, size);
-    if (copied != 0){
-        kfree(buffer);
-        printk("%s: put_data() - copy_from_user() unable to read the full message\n", MOD_NAME);
-        return -EMSGSIZE;
+    // the page of the per-block index that will keep the block is allocated the first time it is needed
+    if (valid_blk_index_prepare(dev, target_block) < 0){
+        ret = -ENOMEM;
+        goto error_release;
     }
 
     /*
-    * Make all the required allocations before the critical section, in order to make it
-    * the shortest as possible; furthermore, this reduces the presence of eventual blocking calls in the CS.
+    * WRITE PHASE
+    * The reserved block is not valid, so no reader accesses it: the message is copied from user space
+    * straight into the cached page of the block, out of the critical section. Only the bytes after the message
+    * are zeroed; the header is written once the timestamp is assigned.
+    * The whole content of the block is rewritten, so its old content is not read from the device:
+    * the buffer is only looked up (or created) in the cache and kept locked, so that the writeback
+    * can not flush it until it is complete.
     */
-    new_elem = kzalloc(sizeof(rcu_elem), GFP_ATOMIC);
-    if(!new_elem){
-        kfree(buffer);
-        return -EADDRNOTAVAIL;
+    bh = sb_getblk(sb, data_block_nr(dev, target_block));
+    if (!bh){
+        ret = -EIO;
+        goto error_release;
     }
+    lock_buffer(bh);
 
-    new_metadata = kzalloc(sizeof(bldms_block), GFP_ATOMIC);
-    if(!new_metadata){
-        kfree(buffer);
-        kfree(new_elem);
-        return -EADDRNOTAVAIL;
+    copied = copy_from_user(bh->b_data + METADATA_SIZE, source, size);
+    if (copied != 0){
+        printk("%s: put_data() - copy_from_user() unable to read the full message\n", MOD_NAME);
+        ret = -EMSGSIZE;
+        goto error_brelse;
     }
+    memset(bh->b_data + METADATA_SIZE + size, 0, DEFAULT_BLOCK_SIZE - METADATA_SIZE - size);
 
     /*
-    * The following calls are always performed, also if they could be not necessary:
-    * e.g. there are no free blocks where to write. They are anticipated here in order to reduce 
-    * the size of the critical section and to avoid the introduction of blocking calls in the CS.
-    * 
-    * WARNING: calling ktime_get_real() here could result in an out of (timestamp) order
-    * insertion in the RCU list. (This thread could sleep after the function returned and another thread, 
-    * with a bigger timestamp, could just take the writing spinlock before this one). 
-    * Adding the new node to the tail of the RCU list is not safe and an in-order insertion is required
-    * to guarantee the ordering of the list.
+    * From format version 2 on, the header is also written in the metadata table: a block of the table that is not
+    * cached is rebuilt from the index, so that put_data() does not read from the device.
     */
-    old_metadata = NULL;
-    // get the actual time as creation timestamp for the message
-    new_metadata->nsec = ktime_get_real();
-    AUDIT
-        printk("%s: put_data() - creation timestamp for the new message is %lld\n", MOD_NAME, new_metadata->nsec);
-    new_metadata->valid_bytes = size;
-    new_metadata->is_valid = BLK_VALID;
-    // write the block metadata in the in-memory buffer
-    memcpy(buffer, (char *)new_metadata, sizeof(bldms_block));
+    if (has_md_table(dev)){
+        md_bh = get_metadata_block(dev, target_block);
+        if (!md_bh){
+            ret = -EIO;
+            goto error_brelse;
+        }
+    }
 
     /*
-    * BEGINNING OF CRITICAL SECTION
+    * PUBLISH PHASE - BEGINNING OF CRITICAL SECTION
     * 
     * getting the write lock here: this way, 
-    * we can be sure that the metadata array is not accesed by anyone else in the meanwhile.
+    * we can be sure that the RCU list and its index are not accesed by anyone else in the meanwhile.
+    * No I/O is done while holding it.
     */
-    spin_lock(&rcu_write_lock);
-    target_block = -1;
-    for(i = 1; i <= md_array_size; i++){
-        /*
-        * The next free block to perform the valid operation is chosen 
-        * in a circular buffer manner, starting from the block following the last written one.
-        */
-        curr_blk = (last_written_block + i) % md_array_size;
-        if (metadata_array[curr_blk]->is_valid == BLK_INVALID){
-            // this is the target block
-            target_block = curr_blk;
-            break;
-        }
-    }
+    spin_lock(&dev->rcu_write_lock);
 
-    if (target_block < 0){
-        // no available free blocks
-        ret = -ENOMEM;
-        goto error;
-    }
+    /*
+    * The creation timestamp of the message is assigned inside the critical section: it is the current time,
+    * made strictly bigger than any previously assigned one. So, the order of the timestamps is the order
+    * of the insertions and the new node can be simply appended to the tail of the RCU list, in O(1).
+    */
+    new_metadata.nsec = next_timestamp_secure(dev);
+    AUDIT
+        printk("%s: put_data() - creation timestamp for the new message is %lld\n", MOD_NAME, new_metadata.nsec);
+
+    memcpy(bh->b_data, (char *)&new_metadata, METADATA_SIZE);
+
+    // add the element to the tail of the RCU list
+    add_valid_block_secure(dev, new_elem, target_block , new_metadata.valid_bytes, new_metadata.nsec);
 
-    old_metadata = metadata_array[target_block];
+    // release the lock to make changes effective
+    spin_unlock(&dev->rcu_write_lock);
 
     /*
-    * Since the target block is invalid, it surely will never become valid until the write_lock is released.
-    * Although, the moment after the RCU element is added to the list, some reader could request the block
-    * and read it from the device. So, first make sure to write the block on the device and then update the RCU list.
+    * The moment after the RCU element is added to the list, some reader could request the block:
+    * reading it from the buffer cache waits for the buffer to be unlocked, i.e. to be complete and up to date.
     */
-    bh = sb_bread(sb, target_block + NUM_METADATA_BLKS);
-    if (!bh){
-        ret = -1;
-        goto error;
-    }
-    
-    memcpy(bh->b_data, buffer, DEFAULT_BLOCK_SIZE);
-    bh->b_size = DEFAULT_BLOCK_SIZE;
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
     mark_buffer_dirty(bh);
 
-    // add the element to the RCU list, after the block is effectively available on the device
-    // to avoid wrong ordering of the RCU list, invoke the in order insertion of the node
-    add_valid_block_in_order_secure(new_elem, target_block , new_metadata->valid_bytes, new_metadata->nsec);
-
-    // update the metadata structure and the last written block and release the lock to make changes effective
-    metadata_array[target_block] = new_metadata;
-    last_written_block = target_block;
-    spin_unlock(&rcu_write_lock);
-
-#if SYNCHRONOUS_PUT_DATA
-    // synchronously flush the changes on the block device: this is a blocking call that can increase the duration of the CS
-    sync_dirty_buffer(bh);
-#endif
+    /*
+    * Depending on the durability mode, synchronously flush the changes on the block device, outside of the critical section
+    * since it is a blocking call; in group mode, the write is batched with the ones of the concurrent writers.
+    * In format version 2, the message is made durable before its entry of the metadata table.
+    */
+    if (make_durable(dev, bh) < 0)
+        printk("%s: put_data() - unable to flush block %ld on the device\n", MOD_NAME, target_block);
     brelse(bh);
 
+    if (md_bh){
+        update_metadata(dev, md_bh, target_block);
+        if (make_durable(dev, md_bh) < 0)
+            printk("%s: put_data() - unable to flush the metadata of block %ld on the device\n", MOD_NAME, target_block);
+        brelse(md_bh);
+    }
+
     /* END OF CRITICAL SECTION */
-    kfree(buffer);
-    kfree(old_metadata);
-    return (int)target_block;
+    return target_block;
 
-error:
-    spin_unlock(&rcu_write_lock);
+error_brelse:
+    discard_write(bh);
+error_release:
+    release_block(dev, target_block);
 
-    kfree(new_elem);
-    kfree(buffer);
-    kfree(new_metadata);
-    if(old_metadata != NULL)
-        kfree(old_metadata);
+    rcu_elem_free(new_elem);
 
     printk("%s: error occurred during put_data()\n", MOD_NAME);
     return ret;
 }
 
+// state of a batch of messages of put_data_batch(), too big to be kept on the stack
+struct put_batch {
+    struct bldms_put_desc desc[BLDMS_MAX_BATCH];
+    long res[BLDMS_MAX_BATCH];                  // index of the block of each message, or its error
+    rcu_elem *el[BLDMS_MAX_BATCH];              // NULL for the messages that are not written
+    struct buffer_head *bh[BLDMS_MAX_BATCH];
+    struct buffer_head *md_bh[BLDMS_MAX_BATCH];
+    uint64_t blocks[BLDMS_MAX_BATCH];
+    struct buffer_head *flush[BLDMS_MAX_BATCH];
+};
+
+
+/*
+* WRITE PHASE of a message of a batch, on its reserved block: the same as the one of do_put_data().
+* On success, the buffer of the block is kept locked until the message is published.
+*/
+static int put_batch_write(struct bldms_dev *dev, struct put_batch *b, unsigned int i){
+    uint64_t target_block = b->res[i];
+    int ret;
+
+    if (valid_blk_index_prepare(dev, target_block) < 0)
+        return -ENOMEM;
+
+    b->bh[i] = sb_getblk(dev->sb, data_block_nr(dev, target_block));
+    if (!b->bh[i])
+        return -EIO;
+    lock_buffer(b->bh[i]);
+
+    if (copy_from_user(b->bh[i]->b_data + METADATA_SIZE, b->desc[i].source, b->desc[i].size) != 0){
+        printk("%s: put_data_batch() - copy_from_user() unable to read the full message %u\n", MOD_NAME, i);
+        ret = -EMSGSIZE;
+        goto error_brelse;
+    }
+    memset(b->bh[i]->b_data + METADATA_SIZE + b->desc[i].size, 0, DEFAULT_BLOCK_SIZE - METADATA_SIZE - b->desc[i].size);
+
+    if (has_md_table(dev)){
+        b->md_bh[i] = get_metadata_block(dev, target_block);
+        if (!b->md_bh[i]){
+            ret = -EIO;
+            goto error_brelse;
+        }
+    }
+    return 0;
+
+error_brelse:
+    discard_write(b->bh[i]);
+    b->bh[i] = NULL;
+    return ret;
+}
+
+
 /**
- * @brief  get_data() system call - get the content of a block if it is valid
- * In case the requested block is invalid, errno is set to ENODATA.
- * 
- * The parameter "offset" is intended as the number of the block of the device
+ * @brief  Add several messages in free blocks of the device: body of the put_data_batch() system call.
+ *         The caller must hold a reference to the device, taken through bldms_dev_get().
+ *         The same phases of do_put_data() are run once for the whole batch: the blocks are reserved at once,
+ *         all the messages are published in a single critical section, with consecutive timestamps, and in sync
+ *         and group modes they are flushed with a single submission.
+ * @param  results: filled with the index of the block of each message, or with its negative error code
+ *         (E2BIG if the message is too big, ENOMEM if there are no free blocks left for it)
+ * @retval The number of messages written, a negative error code if none of them can be handled.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
-__SYSCALL_DEFINEx(3, _get_data, int, offset, char *, destination, size_t, size){
-#else
-asmlinkage int sys_get_data(int offset, char *destination, size_t size){
-#endif
-    int bytes_to_copy;
+static long do_put_data_batch(struct bldms_dev *dev, struct bldms_put_desc *descs, unsigned int n, long *results){
+    struct put_batch *b;
+    bldms_block new_metadata;
+    unsigned int i, k, nr_msgs = 0, got, nr_flush;
+    long ret;
+
+    if (n == 0 || n > BLDMS_MAX_BATCH)
+        return -EINVAL;
+
+    b = kzalloc(sizeof(struct put_batch), GFP_KERNEL);
+    if (!b)
+        return -ENOMEM;
+
+    if (copy_from_user(b->desc, descs, n * sizeof(struct bldms_put_desc)) != 0){
+        ret = -EFAULT;
+        goto out;
+    }
+
+    // the allocations are made before the critical section, as in do_put_data()
+    for (i = 0; i < n; i++){
+        if (b->desc[i].size > DEFAULT_BLOCK_SIZE - METADATA_SIZE){
+            b->res[i] = -E2BIG;
+            continue;
+        }
+        b->el[i] = rcu_elem_alloc(GFP_KERNEL);
+        if (!b->el[i]){
+            b->res[i] = -EADDRNOTAVAIL;
+            continue;
+        }
+        nr_msgs++;
+    }
+
+    /*
+    * RESERVE PHASE
+    * The free blocks of all the messages are reserved at once, in the circular allocation order:
+    * the messages that do not get a block fail with ENOMEM.
+    */
+    got = alloc_free_blocks(dev, b->blocks, nr_msgs);
+    for (i = 0, k = 0; i < n; i++){
+        if (!b->el[i])
+            continue;
+        if (k == got){
+            b->res[i] = -ENOMEM;
+        }else{
+            b->res[i] = b->blocks[k++];
+            ret = put_batch_write(dev, b, i);
+            if (ret == 0)
+                continue;
+            release_block(dev, b->res[i]);
+            b->res[i] = ret;
+        }
+        rcu_elem_free(b->el[i]);
+        b->el[i] = NULL;
+    }
+
+    /*
+    * PUBLISH PHASE - BEGINNING OF CRITICAL SECTION
+    * All the messages get their timestamp and are appended to the tail of the RCU list with the writing spinlock
+    * taken only once: they are published in the order of the batch, with no other message in between.
+    */
+    new_metadata.is_valid = BLK_VALID;
+    spin_lock(&dev->rcu_write_lock);
+    for (i = 0; i < n; i++){
+        if (!b->el[i])
+            continue;
+        new_metadata.nsec = next_timestamp_secure(dev);
+        new_metadata.valid_bytes = b->desc[i].size;
+        memcpy(b->bh[i]->b_data, (char *)&new_metadata, METADATA_SIZE);
+        add_valid_block_secure(dev, b->el[i], b->res[i], new_metadata.valid_bytes, new_metadata.nsec);
+    }
+    spin_unlock(&dev->rcu_write_lock);
+    /* END OF CRITICAL SECTION */
+
+    nr_flush = 0;
+    nr_msgs = 0;
+    for (i = 0; i < n; i++){
+        if (!b->el[i])
+            continue;
+        set_buffer_uptodate(b->bh[i]);
+        unlock_buffer(b->bh[i]);
+        mark_buffer_dirty(b->bh[i]);
+        b->flush[nr_flush++] = b->bh[i];
+        nr_msgs++;
+    }
+
+    // the messages are made durable before their entries of the metadata table, as in do_put_data()
+    if (make_durable_many(b->flush, nr_flush) < 0)
+        printk("%s: put_data_batch() - unable to flush the blocks on the device\n", MOD_NAME);
+
+    nr_flush = 0;
+    for (i = 0; i < n; i++){
+        if (!b->el[i] || !b->md_bh[i])
+            continue;
+        update_metadata(dev, b->md_bh[i], b->res[i]);
+        // consecutive blocks usually keep their headers in the same block of the table
+        if (nr_flush == 0 || b->flush[nr_flush - 1] != b->md_bh[i])
+            b->flush[nr_flush++] = b->md_bh[i];
+    }
+    if (make_durable_many(b->flush, nr_flush) < 0)
+        printk("%s: put_data_batch() - unable to flush the metadata on the device\n", MOD_NAME);
+
+    for (i = 0; i < n; i++){
+        brelse(b->bh[i]);
+        brelse(b->md_bh[i]);
+    }
+
+    // the messages are already written, even if their indexes can not be delivered
+    ret = nr_msgs;
+    if (copy_to_user(results, b->res, n * sizeof(long)) != 0)
+        ret = -EFAULT;
+
+out:
+    kfree(b);
+    return ret;
+}
+
+/*
+* The content of a valid block is not read inside the RCU read-side critical section, since reading it from the device
+* sleeps: the timestamp of the message is taken with the validity check, the content is copied out of the read-side
+* section, then the check is repeated. A block is rewritten only after it has been invalidated, and timestamps are
+* never reused, so if the same message is still in the index after the copy, the copied content is the one of the
+* message; otherwise the block has been invalidated meanwhile and ENODATA is returned, as if the invalidation came first.
+*/
+
+/*
+* Validity check of the block "offset": it gives the number of bytes of the message to be delivered, up to "size",
+* and its timestamp. It must be called inside an RCU read-side critical section.
+*/
+static inline long lookup_message(struct bldms_dev *dev, long offset, size_t size, ktime_t *nsec){
+    rcu_elem *rcu_el = lookup_valid_block(dev, offset);
+
+    if (!rcu_el)
+        return -ENODATA;
+    *nsec = rcu_el->nsec;
+    // if size is greater then the message's valid bytes, copy only valid bytes
+    return (size > rcu_el->valid_bytes) ? rcu_el->valid_bytes : size;
+}
+
+
+/*
+* Copy the first "bytes" bytes of the message of timestamp "nsec", found in the block "offset" by lookup_message(),
+* into the user space buffer, then check that the message is still valid.
+*/
+static long copy_message(struct bldms_dev *dev, long offset, ktime_t nsec, size_t bytes, char *destination){
+    struct buffer_head *bh;
     unsigned long not_copied;
-    uint32_t target_block;
     rcu_elem *rcu_el;
-    struct super_block *sb;
-    struct buffer_head *bh;
+    bool valid;
 
-    if(!bldms_mounted){
-        return -ENODEV;
+    bh = sb_bread(dev->sb, data_block_nr(dev, offset));
+    if(!bh){
+        return -EIO;
+    }
+    // write the read data into the specified user-space buffer
+    not_copied = copy_to_user(destination, bh->b_data + METADATA_SIZE, (unsigned long)bytes);
+    brelse(bh);
+
+    // the content must be read before the index is checked again
+    smp_rmb();
+    rcu_read_lock();
+    rcu_el = lookup_valid_block(dev, offset);
+    valid = (rcu_el && rcu_el->nsec == nsec);
+    rcu_read_unlock();
+
+    if(!valid){
+        AUDIT
+            printk("%s: get_data() - block %ld invalidated while being read\n", MOD_NAME, offset);
+        return -ENODATA;
     }
+    return (bytes - not_copied);
+}
+
+
+/**
+ * @brief  Get the content of a block if it is valid: body of the get_data() system calls.
+ * In case the requested block is invalid, errno is set to ENODATA.
+ * 
+ * The parameter "offset" is intended as the number of the block of the device
+ */
+static long do_get_data(struct bldms_dev *dev, long offset, char *destination, size_t size){
+    long ret;
+    ktime_t nsec;
 
-    if(offset >= md_array_size){
+    if(offset < 0 || offset >= dev->md_array_size){
         // the specified block does not exist in the device
         return -E2BIG;
     }
 
-    target_block = offset + NUM_METADATA_BLKS;
-
-    // get a reference to the device superblock
-    sb = the_dev_superblock;
-    if(!sb){
-        return -EINVAL;
+    // in a lazy mount, the block may not have been scanned yet
+    ret = ensure_scanned(dev, offset);
+    if(ret < 0){
+        return ret;
     }
 
     /* 
-    * RCU read-side critical section beginning:
-    * scan the RCU list of valid blocks to check if the requested block
-    * is actually valid.
+    * RCU read-side critical section:
+    * look up the requested block in the per-block index of the RCU list
+    * to check if it is actually valid; hits and misses have the same constant cost.
     */
     rcu_read_lock();
-    list_for_each_entry_rcu(rcu_el, &valid_blk_list, node){
-        if(rcu_el->ndx == offset){
-            // the block is valid and is found
-            bytes_to_copy = rcu_el->valid_bytes;
-            break;
-        }
-    }
+    ret = lookup_message(dev, offset, size, &nsec);
+    rcu_read_unlock();
 
     // if no block has been found, return -ENODATA: the requested block does not contain valid data
-    if(&(rcu_el->node) == &valid_blk_list){
-        rcu_read_unlock();
+    if(ret < 0){
         AUDIT
-            printk("%s: get_data() - no valid block with offset %d\n", MOD_NAME, offset);
-        return -ENODATA;
+            printk("%s: get_data() - no valid block with offset %ld\n", MOD_NAME, offset);
+        return ret;
     }
 
-    bh = sb_bread(sb, target_block);
-    if(!bh){
-        rcu_read_unlock();
-        return -1;
+    return copy_message(dev, offset, nsec, ret, destination);
+}
+
+
+// state of the blocks requested by get_data_multi(), too big to be kept on the stack
+struct get_batch {
+    struct bldms_get_desc desc[BLDMS_MAX_BATCH];
+    long res[BLDMS_MAX_BATCH];                  // bytes to be delivered for each block, then delivered, or its error
+    ktime_t nsec[BLDMS_MAX_BATCH];              // timestamp of the message found by the validity check
+    struct {
+        uint64_t ndx;
+        unsigned int i;                         // position of the block in the request
+    } order[BLDMS_MAX_BATCH];                   // valid blocks, in physical order
+};
+
+
+static int block_order_cmp(const void *a, const void *b){
+    const uint64_t *x = a, *y = b;
+
+    // the data blocks follow the order of the indexes
+    return (*x < *y) ? -1 : (*x > *y);
+}
+
+
+/**
+ * @brief  Get the content of several blocks: body of the get_data_multi() system call.
+ *         The caller must hold a reference to the device, taken through bldms_dev_get().
+ *         The validity of all the blocks is checked in a single RCU read-side critical section; then, the reads
+ *         of the valid blocks are submitted together, in physical order, and the messages are delivered in the
+ *         same order, each one checked again as in get_data().
+ * @param  results: filled with the number of bytes delivered for each block, or with its negative error code
+ *         (ENODATA if the block is not valid, E2BIG if it does not exist)
+ * @retval The number of blocks whose content has been delivered, a negative error code if the arguments are not valid.
+ */
+static long do_get_data_multi(struct bldms_dev *dev, struct bldms_get_desc *descs, unsigned int n, long *results){
+    struct get_batch *b;
+    struct blk_plug plug;
+    unsigned int i, k, nr_valid = 0;
+    long ret, offset;
+
+    if (n == 0 || n > BLDMS_MAX_BATCH)
+        return -EINVAL;
+
+    b = kmalloc(sizeof(struct get_batch), GFP_KERNEL);
+    if (!b)
+        return -ENOMEM;
+
+    if (copy_from_user(b->desc, descs, n * sizeof(struct bldms_get_desc)) != 0){
+        ret = -EFAULT;
+        goto out;
     }
 
-    // if size is greater then the message's valid bytes, copy only valid bytes
-    bytes_to_copy = (size > bytes_to_copy) ? bytes_to_copy : size;
-    // write the read data into the specified user-space buffer
-    not_copied = copy_to_user(destination, bh->b_data + METADATA_SIZE, (unsigned long)bytes_to_copy);
-    brelse(bh);
+    // in a lazy mount, the blocks may not have been scanned yet
+    for (i = 0; i < n; i++){
+        offset = b->desc[i].offset;
+        b->res[i] = (offset < 0 || offset >= dev->md_array_size) ? -E2BIG : ensure_scanned(dev, offset);
+    }
 
-    /* 
-    * The RCU read-side critical section can't finish before this point,
-    * because we have to be sure that the content on the device is consistent with respect to
-    * what blocks are considered valid, i.e. present in the RCU list.
-    * Just after signaling the end of the read-side critical section, an overwrite of data
-    * on the device could happen (a waiting writer wants to invalidate the block). 
-    */
+    // a single RCU read-side critical section for the validity check of all the blocks
+    rcu_read_lock();
+    for (i = 0; i < n; i++){
+        if (b->res[i] < 0)
+            continue;
+        b->res[i] = lookup_message(dev, b->desc[i].offset, b->desc[i].size, &b->nsec[i]);
+        if (b->res[i] < 0)
+            continue;
+        b->order[nr_valid].ndx = b->desc[i].offset;
+        b->order[nr_valid].i = i;
+        nr_valid++;
+    }
     rcu_read_unlock();
-    return (bytes_to_copy - not_copied);
+
+    /*
+    * The reads of all the valid blocks that are not cached are submitted at once, in physical order,
+    * so that the block layer can merge the adjacent ones; the blocks are then delivered in the same order.
+    */
+    sort(b->order, nr_valid, sizeof(b->order[0]), block_order_cmp, NULL);
+    blk_start_plug(&plug);
+    for (k = 0; k < nr_valid; k++)
+        sb_breadahead(dev->sb, data_block_nr(dev, b->order[k].ndx));
+    blk_finish_plug(&plug);
+
+    ret = 0;
+    for (k = 0; k < nr_valid; k++){
+        i = b->order[k].i;
+        b->res[i] = copy_message(dev, b->desc[i].offset, b->nsec[i], b->res[i], b->desc[i].destination);
+        if (b->res[i] >= 0)
+            ret++;
+    }
+
+    if (copy_to_user(results, b->res, n * sizeof(long)) != 0)
+        ret = -EFAULT;
+
+out:
+    kfree(b);
+    return ret;
 }
 
 
 /**
- * @brief  invalidate_data() system call - mark a valid block of the device as logically invalid.
+ * @brief  Mark a valid block of the device as logically invalid: body of the invalidate_data() system calls.
  * If no valid block with the specified offset is found, errno will be set to ENODATA.
  * 
  * The "offset" parameter is intended as the index of the target device's block.
  * The invalidation is only logical: only the validity bit of the block will be affected; the previous content
  * of the block is untouched and remains on the device.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
-__SYSCALL_DEFINEx(1, _invalidate_data, int, offset){
-#else
-asmlinkage int sys_invalidate_data(int offset){
-#endif
-    uint32_t target_block;
+static long do_invalidate_data(struct bldms_dev *dev, long offset){
+    int ret;
     rcu_elem *rcu_el;
-    struct super_block *sb;
     struct buffer_head *bh;
 
-    if(!bldms_mounted){
-        return -ENODEV;
-    }
-
-    if(offset >= md_array_size){
+    if(offset < 0 || offset >= dev->md_array_size){
         // the specified block does not exist in the device
         return -E2BIG;
     }
 
-    target_block = offset + NUM_METADATA_BLKS;
-
-    // get a reference to the superblock
-    sb = the_dev_superblock;
+    // in a lazy mount, the block may not have been scanned yet
+    ret = ensure_scanned(dev, offset);
+    if(ret < 0){
+        return ret;
+    }
 
     /*
-    * BEGINNING OF CRITICAL SECTION (RCU write-side)
+    * The block keeping the header (the data block itself in format version 1, a block of the metadata table in version 2)
+    * is read from the device before the critical section, in order to stop in case of error
+    * before the node is removed from the RCU list. A block that is not valid is detected without any lock
+    * and without I/O; if the block becomes invalid meanwhile, it is detected again inside the critical section.
     */
-    spin_lock(&rcu_write_lock);
-    list_for_each_entry_rcu(rcu_el, &valid_blk_list, node){
-        if(rcu_el->ndx == offset){
-            // requested block is valid and must be invalidated
-            break;
-        }
+    rcu_read_lock();
+    rcu_el = lookup_valid_block(dev, offset);
+    rcu_read_unlock();
+    if(!rcu_el)
+        goto no_data;
+
+    bh = read_metadata_block(dev, offset);
+    if(!bh){
+        return -EIO;
     }
 
+    /*
+    * RESERVE PHASE - BEGINNING OF CRITICAL SECTION (RCU write-side)
+    * Remove the block from the RCU list and release the lock to make changes effective:
+    * the writing spinlock only protects the ordered index of the valid blocks.
+    */
+    spin_lock(&dev->rcu_write_lock);
+    rcu_el = lookup_valid_block_secure(dev, offset);
+
     // if no block has been found, return -ENODATA error
-    if(&(rcu_el->node) == &valid_blk_list){
+    if(!rcu_el){
         // no need for rcu synchronization, since no RCU changes have been made
-        spin_unlock(&rcu_write_lock);
-        AUDIT
-            printk("%s: invalidate_data() - no valid block with offset %d\n", MOD_NAME, offset);
-        return -ENODATA;
+        spin_unlock(&dev->rcu_write_lock);
+        brelse(bh);
+        goto no_data;
     }
+    del_valid_block_secure(dev, rcu_el);
+    spin_unlock(&dev->rcu_write_lock);
 
-    // get the block in buffer head to stop in case of error before the node is removed from the RCU list
-    bh = sb_bread(sb, target_block);
-    if(!bh){
-        // no need for rcu synchronization, since no RCU changes have been made
-        spin_unlock(&rcu_write_lock);
-        return -1;
-    }
-    
     /*
-    * Remove the block from the RCU list, invalidate the entry of the array metadata,
-    * release the lock to make changes effective and wait for grace period end 
-    * to rewrite its metadata on the device and free the RCU elem structure.
+    * WRITE PHASE
+    * Once unlinked, the block is owned by this invalidation only, until it is released:
+    * its header is rewritten as not valid, since the block is no more in the index, without holding the writing spinlock.
     */
-    list_del_rcu(&(rcu_el->node));
-    metadata_array[rcu_el->ndx]->is_valid = BLK_INVALID;
-
-    // rewrite metadata on the device in order to be consistent
-    memcpy(bh->b_data, metadata_array[rcu_el->ndx], METADATA_SIZE);
-    mark_buffer_dirty(bh);
+    update_metadata(dev, bh, offset);
 
-    spin_unlock(&rcu_write_lock);
+    /*
+    * PUBLISH PHASE
+    * The block can be reused by put_data() only after its invalid header is in the buffer cache.
+    */
+    release_block(dev, offset);
 
-    // wait for grace period end
-    synchronize_rcu();
+    /*
+    * Readers may still hold a reference to the removed element: it is freed by an RCU callback
+    * at the end of the grace period, so the system call does not need to wait for it.
+    */
+    reclaim_valid_block(rcu_el);
     
-#if SYNCHRONOUS_PUT_DATA
-    sync_dirty_buffer(bh);
-#endif
+    if (make_durable(dev, bh) < 0)
+        printk("%s: invalidate_data() - unable to flush block %ld on the device\n", MOD_NAME, offset);
     brelse(bh);
 
-    // free the rcu elem struct
-    kfree(rcu_el);
     AUDIT
-        printk("%s: invalidate_data() on block %d has been executed correctly\n", MOD_NAME, offset);
+        printk("%s: invalidate_data() on block %ld has been executed correctly\n", MOD_NAME, offset);
     // return 0 on success
     return 0;
+
+no_data:
+    AUDIT
+        printk("%s: invalidate_data() - no valid block with offset %ld\n", MOD_NAME, offset);
+    return -ENODATA;
+}
+
+
+/*
+* The system calls take a reference to the target device for their whole duration, so that it can not be unmounted
+* under them: put_data(), get_data() and invalidate_data() work on the device of id 0, while their "_dev" variants
+* take the id of the target device as their first argument. A device that is not mounted gives the ENODEV error.
+*/
+
+/**
+ * @brief  put_data() system call - add a message in a free block of the default BLDMS device
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(2, _put_data, char *, source, size_t, size){
+#else
+asmlinkage long sys_put_data(char *source, size_t size){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(BLDMS_DEFAULT_DEV);
+    if (!dev)
+        return -ENODEV;
+    ret = do_put_data(dev, source, size);
+    bldms_dev_put(dev);
+    return ret;
+}
+
+/**
+ * @brief  put_data_dev() system call - add a message in a free block of the BLDMS device of id "dev_id"
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(3, _put_data_dev, int, dev_id, char *, source, size_t, size){
+#else
+asmlinkage long sys_put_data_dev(int dev_id, char *source, size_t size){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(dev_id);
+    if (!dev)
+        return -ENODEV;
+    ret = do_put_data(dev, source, size);
+    bldms_dev_put(dev);
+    return ret;
+}
+
+/**
+ * @brief  put_data_batch() system call - add "n" messages, described by "descs", in free blocks of the BLDMS device
+ *         of id "dev_id"; "results" receives the index of the block of each message, or its error
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(4, _put_data_batch, int, dev_id, struct bldms_put_desc *, descs, unsigned int, n, long *, results){
+#else
+asmlinkage long sys_put_data_batch(int dev_id, struct bldms_put_desc *descs, unsigned int n, long *results){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(dev_id);
+    if (!dev)
+        return -ENODEV;
+    ret = do_put_data_batch(dev, descs, n, results);
+    bldms_dev_put(dev);
+    return ret;
+}
+
+/**
+ * @brief  get_data() system call - get the content of a block of the default BLDMS device, if it is valid
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(3, _get_data, long, offset, char *, destination, size_t, size){
+#else
+asmlinkage long sys_get_data(long offset, char *destination, size_t size){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(BLDMS_DEFAULT_DEV);
+    if (!dev)
+        return -ENODEV;
+    ret = do_get_data(dev, offset, destination, size);
+    bldms_dev_put(dev);
+    return ret;
+}
+
+/**
+ * @brief  get_data_dev() system call - get the content of a block of the BLDMS device of id "dev_id", if it is valid
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(4, _get_data_dev, int, dev_id, long, offset, char *, destination, size_t, size){
+#else
+asmlinkage long sys_get_data_dev(int dev_id, long offset, char *destination, size_t size){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(dev_id);
+    if (!dev)
+        return -ENODEV;
+    ret = do_get_data(dev, offset, destination, size);
+    bldms_dev_put(dev);
+    return ret;
+}
+
+/**
+ * @brief  get_data_multi() system call - get the content of the "n" blocks described by "descs" of the BLDMS device
+ *         of id "dev_id"; "results" receives the number of bytes delivered for each block, or its error
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(4, _get_data_multi, int, dev_id, struct bldms_get_desc *, descs, unsigned int, n, long *, results){
+#else
+asmlinkage long sys_get_data_multi(int dev_id, struct bldms_get_desc *descs, unsigned int n, long *results){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(dev_id);
+    if (!dev)
+        return -ENODEV;
+    ret = do_get_data_multi(dev, descs, n, results);
+    bldms_dev_put(dev);
+    return ret;
+}
+
+/**
+ * @brief  invalidate_data() system call - mark a valid block of the default BLDMS device as logically invalid
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(1, _invalidate_data, long, offset){
+#else
+asmlinkage long sys_invalidate_data(long offset){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(BLDMS_DEFAULT_DEV);
+    if (!dev)
+        return -ENODEV;
+    ret = do_invalidate_data(dev, offset);
+    bldms_dev_put(dev);
+    return ret;
+}
+
+/**
+ * @brief  invalidate_data_dev() system call - mark a valid block of the BLDMS device of id "dev_id" as logically invalid
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0)
+__SYSCALL_DEFINEx(2, _invalidate_data_dev, int, dev_id, long, offset){
+#else
+asmlinkage long sys_invalidate_data_dev(int dev_id, long offset){
+#endif
+    struct bldms_dev *dev;
+    long ret;
+
+    dev = bldms_dev_get(dev_id);
+    if (!dev)
+        return -ENODEV;
+    ret = do_invalidate_data(dev, offset);
+    bldms_dev_put(dev);
+    return ret;
 }
 
 
@@ -384,6 +847,11 @@ asmlinkage int sys_invalidate_data(int offset){
 long sys_put_data = (unsigned long) __x64_sys_put_data;
 long sys_get_data = (unsigned long) __x64_sys_get_data;
 long sys_invalidate_data = (unsigned long) __x64_sys_invalidate_data;
+long sys_put_data_dev = (unsigned long) __x64_sys_put_data_dev;
+long sys_get_data_dev = (unsigned long) __x64_sys_get_data_dev;
+long sys_invalidate_data_dev = (unsigned long) __x64_sys_invalidate_data_dev;
+long sys_put_data_batch = (unsigned long) __x64_sys_put_data_batch;
+long sys_get_data_multi = (unsigned long) __x64_sys_get_data_multi;
 #else
 #endif
 
@@ -392,7 +860,9 @@ long sys_invalidate_data = (unsigned long) __x64_sys_invalidate_data;
  */
 int register_syscalls(void){
     int ret, i;
-    char *syscall_names[HACKED_ENTRIES] = {"put_data()", "get_data()", "invalidate_data()"};
+    char *syscall_names[HACKED_ENTRIES] = {"put_data()", "get_data()", "invalidate_data()",
+                                           "put_data_dev()", "get_data_dev()", "invalidate_data_dev()",
+                                           "put_data_batch()", "get_data_multi()"};
 
     ret = get_entries(restore_entries, indexes, HACKED_ENTRIES, &the_syscall_table, &the_ni_syscall);
     if(ret != HACKED_ENTRIES){
@@ -404,10 +874,20 @@ int register_syscalls(void){
      * 1. put_data();
      * 2. get_data();
      * 3. invalidate_data();
+     * 4. put_data_dev();
+     * 5. get_data_dev();
+     * 6. invalidate_data_dev();
+     * 7. put_data_batch();
+     * 8. get_data_multi();
      */
     new_sys_call_array[0] = (unsigned long)sys_put_data;
     new_sys_call_array[1] = (unsigned long)sys_get_data;
     new_sys_call_array[2] = (unsigned long)sys_invalidate_data;
+    new_sys_call_array[3] = (unsigned long)sys_put_data_dev;
+    new_sys_call_array[4] = (unsigned long)sys_get_data_dev;
+    new_sys_call_array[5] = (unsigned long)sys_invalidate_data_dev;
+    new_sys_call_array[6] = (unsigned long)sys_put_data_batch;
+    new_sys_call_array[7] = (unsigned long)sys_get_data_multi;
 
     unprotect_memory();
     for(i=0; i<HACKED_ENTRIES; i++){
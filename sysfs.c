@@ -0,0 +1,153 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file sysfs.c
+ * @brief sysfs interface of the BLDMS service: the attributes in /sys/fs/bldms_fs/
+ * expose some internal counters of the driver, in order to monitor it from user space.
+ * @author Andrea Pepe
+ * @date April 22, 2023  
+*/
+
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/fs.h>
+#include <linux/atomic.h>
+
+#include "include/bldms.h"
+#include "include/device.h"
+#include "include/rcu.h"
+#include "include/sysfs.h"
+#include "include/cache.h"
+#include "include/durability.h"
+
+static struct kobject *bldms_kobj;
+
+
+// number of RCU elements removed from the list and waiting for a grace period to be freed
+static ssize_t pending_reclaims_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%d\n", atomic_read(&nr_pending_reclaims));
+}
+
+static struct kobj_attribute pending_reclaims_attr = __ATTR_RO(pending_reclaims);
+
+
+// per-cache counters of the dedicated slab caches
+static ssize_t slab_stats_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return bldms_caches_show(buf);
+}
+
+static struct kobj_attribute slab_stats_attr = __ATTR_RO(slab_stats);
+
+
+// durability mode of the writes: all the modes are listed, the current one between square brackets
+static ssize_t durability_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    enum durability_mode mode, curr = get_durability_mode();
+    ssize_t len = 0;
+
+    for (mode = 0; mode < NR_DURABILITY_MODES; mode++){
+        len += scnprintf(buf + len, PAGE_SIZE - len, (mode == curr) ? "[%s] " : "%s ", durability_mode_name(mode));
+    }
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t durability_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    int mode, ret;
+
+    mode = durability_mode_from_name(buf);
+    if (mode < 0)
+        return mode;
+    ret = set_durability_mode(mode);
+    return ret ? ret : count;
+}
+
+static struct kobj_attribute durability_attr = __ATTR_RW(durability);
+
+
+// period of the flushes of the device in periodic mode, in milliseconds
+static ssize_t flush_interval_ms_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return sprintf(buf, "%u\n", READ_ONCE(flush_interval_ms));
+}
+
+static ssize_t flush_interval_ms_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count){
+    unsigned int ms;
+
+    if (kstrtouint(buf, 10, &ms) || ms == 0)
+        return -EINVAL;
+    set_flush_interval(ms);
+    return count;
+}
+
+static struct kobj_attribute flush_interval_ms_attr = __ATTR_RW(flush_interval_ms);
+
+
+// mounted devices, one per line: id to be passed to the system calls, name of the block device and number of blocks
+static ssize_t devices_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return bldms_devs_show(buf);
+}
+
+static struct kobj_attribute devices_attr = __ATTR_RO(devices);
+
+
+// free space of the mounted devices, one per line: id, free blocks, blocks reserved by the CPUs, free extents, free blocks per group
+static ssize_t free_space_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf){
+    return bldms_devs_free_space_show(buf);
+}
+
+static struct kobj_attribute free_space_attr = __ATTR_RO(free_space);
+
+
+static struct attribute *bldms_attrs[] = {
+    &pending_reclaims_attr.attr,
+    &slab_stats_attr.attr,
+    &durability_attr.attr,
+    &flush_interval_ms_attr.attr,
+    &devices_attr.attr,
+    &free_space_attr.attr,
+    NULL,
+};
+
+static struct attribute_group bldms_attr_group = {
+    .attrs = bldms_attrs,
+};
+
+
+/**
+ * @brief  Create the /sys/fs/bldms_fs directory and its attributes.
+ */
+int bldms_sysfs_init(void){
+    int ret;
+
+    bldms_kobj = kobject_create_and_add(BLDMS_SYSFS_DIR, fs_kobj);
+    if (!bldms_kobj)
+        return -ENOMEM;
+
+    ret = sysfs_create_group(bldms_kobj, &bldms_attr_group);
+    if (ret){
+        kobject_put(bldms_kobj);
+        bldms_kobj = NULL;
+    }
+    return ret;
+}
+
+
+void bldms_sysfs_exit(void){
+    if (!bldms_kobj)
+        return;
+    sysfs_remove_group(bldms_kobj, &bldms_attr_group);
+    kobject_put(bldms_kobj);
+    bldms_kobj = NULL;
+}
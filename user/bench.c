@@ -0,0 +1,550 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file bench.c
+ * @brief Benchmark program for the BLDMS service. It runs one or more measurements, selected by name
+ * on the command line (all of them if no name is given):
+ *      - scalability: throughput of put_data() with 1 up to 64 concurrent writer threads; each writer
+ *        invalidates the block it has just written, so that the device never fills up;
+ *      - invalidate: latency of invalidate_data() from a single thread, on blocks written just before,
+ *        together with the number of reclamations still pending, read from sysfs;
+ *      - churn: sustained put/invalidate load from several writers, printing the statistics of the
+ *        slab caches of the module before and after it;
+ *      - putcost: CPU time spent by a single thread for each put_data(), with messages of different sizes;
+ *        it can be compared between different builds of the module;
+ *      - latency: throughput and median/99th percentile latency of put_data() with 1 and 16 writers; with a module
+ *        compiled for synchronous writes, it shows the effect of the group commit of concurrent puts;
+ *      - batch: throughput of a single writer with put_data() and with put_data_batch() of 32 messages; it runs only
+ *        if the number of put_data_batch() is given through the PUT_DATA_BATCH_NR environment variable.
+ * 
+ * @author Andrea Pepe
+ * @date April 22, 2023  
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
+#include "include/pretty-print.h"
+#include "include/quotes.h"
+
+#define BLK_SIZE (1 << 12)
+#define MAX_WRITERS 64
+#define RUN_SECONDS 3
+#define CHURN_WRITERS 8
+#define MAX_MSG_SIZE (BLK_SIZE - 10)
+#define MAX_SAMPLES (1 << 20)                   // maximum number of latencies recorded by each writer
+#define PENDING_RECLAIMS_PATH "/sys/fs/bldms_fs/pending_reclaims"
+#define SLAB_STATS_PATH "/sys/fs/bldms_fs/slab_stats"
+
+long put_data_nr = 0x0;
+long get_data_nr = 0x0;
+long invalidate_data_nr = 0x0;
+long put_data_batch_nr = 0x0;
+char *device_filepath;
+size_t num_blocks = 0x0;
+
+volatile int stop = 0;                          // set by the main thread when a measurement is over
+int total_errors = 0;
+
+// declaration of macros for calling the system calls
+#define put_data(source, size) \
+            syscall(put_data_nr, source, size)
+
+#define get_data(offset, destination, size) \
+            syscall(get_data_nr, (long)(offset), destination, size)
+
+#define invalidate_data(offset) \
+            syscall(invalidate_data_nr, (long)(offset))
+
+#define put_data_batch(dev, descs, n, results) \
+            syscall(put_data_batch_nr, dev, descs, n, results)
+
+#define BATCH_SIZE 32
+
+// descriptor of a message of put_data_batch(), as defined by the module
+struct bldms_put_desc {
+    char *source;
+    size_t size;
+};
+
+
+/*
+* Writer thread for the scalability measurement: put and invalidate messages until stopped
+*/
+void *put_writer(void *arg){
+    unsigned long *puts = (unsigned long *)arg;
+    char *msg;
+    int ret, i = 0;
+
+    while(!stop){
+        msg = messages[i++ % NUM_MESSAGES];
+        ret = put_data(msg, strlen(msg) + 1);
+        if(ret < 0){
+            if(errno != ENOMEM){
+                __sync_fetch_and_add(&total_errors, 1);
+            }
+            continue;
+        }
+        (*puts)++;
+        if(invalidate_data(ret) < 0 && errno != ENODATA){
+            __sync_fetch_and_add(&total_errors, 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+* put_data() throughput with an increasing number of concurrent writers
+*/
+void bench_scalability(void){
+    pthread_t tids[MAX_WRITERS];
+    unsigned long puts[MAX_WRITERS];
+    unsigned long total;
+    double base = 0, rate;
+    int nthreads, i;
+
+    print_color_bold(YELLOW);
+    printf("put_data() scalability (%d seconds per run)\n", RUN_SECONDS);
+    reset_color();
+    printf("%8s %14s %10s\n", "writers", "puts/s", "speedup");
+
+    for(nthreads = 1; nthreads <= MAX_WRITERS; nthreads *= 2){
+        stop = 0;
+        memset(puts, 0, sizeof(puts));
+        for(i=0; i < nthreads; i++){
+            pthread_create(&tids[i], NULL, put_writer, &puts[i]);
+        }
+        sleep(RUN_SECONDS);
+        stop = 1;
+
+        total = 0;
+        for(i=0; i < nthreads; i++){
+            pthread_join(tids[i], NULL);
+            total += puts[i];
+        }
+
+        rate = (double)total / RUN_SECONDS;
+        if(nthreads == 1)
+            base = rate;
+        printf("%8d %14.0f %9.2fx\n", nthreads, rate, (base > 0) ? rate / base : 0.0);
+        fflush(stdout);
+    }
+}
+
+
+/*
+* Read the number of RCU elements waiting for a grace period, -1 if it is not available
+*/
+long read_pending_reclaims(void){
+    FILE *f;
+    long val = -1;
+
+    f = fopen(PENDING_RECLAIMS_PATH, "r");
+    if(!f)
+        return -1;
+    if(fscanf(f, "%ld", &val) != 1)
+        val = -1;
+    fclose(f);
+    return val;
+}
+
+/*
+* invalidate_data() latency: the device is filled with messages, then all of them are invalidated
+*/
+void bench_invalidate(void){
+    int *blocks;
+    char *msg;
+    size_t written = 0, i;
+    struct timespec start, end;
+    double elapsed;
+    int ret;
+
+    print_color_bold(YELLOW);
+    printf("invalidate_data() latency\n");
+    reset_color();
+
+    blocks = malloc(num_blocks * sizeof(int));
+    if(!blocks){
+        total_errors++;
+        return;
+    }
+
+    for(i=0; i < num_blocks; i++){
+        msg = messages[i % NUM_MESSAGES];
+        ret = put_data(msg, strlen(msg) + 1);
+        if(ret < 0)
+            break;
+        blocks[written++] = ret;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i=0; i < written; i++){
+        if(invalidate_data(blocks[i]) < 0)
+            total_errors++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%14s %14s %18s\n", "invalidations", "us/op", "pending reclaims");
+    printf("%14ld %14.2f %18ld\n", written, (written > 0) ? elapsed * 1e6 / written : 0.0, read_pending_reclaims());
+    fflush(stdout);
+    free(blocks);
+}
+
+
+/*
+* Copy the content of a sysfs file on the standard output
+*/
+void print_sysfs_file(const char *path){
+    char line[256];
+    FILE *f;
+
+    f = fopen(path, "r");
+    if(!f){
+        printf("%s not available\n", path);
+        return;
+    }
+    while(fgets(line, sizeof(line), f))
+        fputs(line, stdout);
+    fclose(f);
+}
+
+/*
+* Sustained put/invalidate load, to observe the behaviour of the slab caches
+*/
+void bench_churn(void){
+    pthread_t tids[CHURN_WRITERS];
+    unsigned long puts[CHURN_WRITERS];
+    unsigned long total = 0;
+    int i;
+
+    print_color_bold(YELLOW);
+    printf("put/invalidate churn (%d writers, %d seconds)\n", CHURN_WRITERS, RUN_SECONDS);
+    reset_color();
+
+    printf("slab caches before:\n");
+    print_sysfs_file(SLAB_STATS_PATH);
+
+    stop = 0;
+    memset(puts, 0, sizeof(puts));
+    for(i=0; i < CHURN_WRITERS; i++){
+        pthread_create(&tids[i], NULL, put_writer, &puts[i]);
+    }
+    sleep(RUN_SECONDS);
+    stop = 1;
+    for(i=0; i < CHURN_WRITERS; i++){
+        pthread_join(tids[i], NULL);
+        total += puts[i];
+    }
+
+    printf("%lu puts/s\nslab caches after:\n", total / RUN_SECONDS);
+    print_sysfs_file(SLAB_STATS_PATH);
+    fflush(stdout);
+}
+
+
+static inline long long thread_cpu_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+* CPU cost of put_data(): only the time spent inside the system call is accounted, the invalidation
+* of the written block (needed to keep the device from filling up) is not
+*/
+void bench_putcost(void){
+    size_t sizes[] = {60, 1024, MAX_MSG_SIZE};
+    char msg[MAX_MSG_SIZE];
+    long long start, cpu_ns;
+    unsigned long puts;
+    time_t end;
+    int i, ret;
+
+    print_color_bold(YELLOW);
+    printf("put_data() CPU cost (%d seconds per size)\n", RUN_SECONDS);
+    reset_color();
+    printf("%10s %12s %14s\n", "bytes", "puts", "CPU ns/put");
+
+    memset(msg, 'x', sizeof(msg));
+    for(i=0; i < (int)(sizeof(sizes)/sizeof(size_t)); i++){
+        puts = 0;
+        cpu_ns = 0;
+        end = time(NULL) + RUN_SECONDS;
+        while(time(NULL) < end){
+            start = thread_cpu_ns();
+            ret = put_data(msg, sizes[i]);
+            cpu_ns += thread_cpu_ns() - start;
+            if(ret < 0){
+                if(errno != ENOMEM)
+                    total_errors++;
+                continue;
+            }
+            puts++;
+            if(invalidate_data(ret) < 0)
+                total_errors++;
+        }
+        printf("%10zu %12lu %14.0f\n", sizes[i], puts, (puts > 0) ? (double)cpu_ns / puts : 0.0);
+        fflush(stdout);
+    }
+}
+
+
+static inline long long monotonic_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct latency_samples {
+    long long *ns;
+    unsigned long count;
+};
+
+/*
+* Writer thread for the latency measurement: like put_writer(), but it records the latency of each put
+*/
+void *latency_writer(void *arg){
+    struct latency_samples *samples = (struct latency_samples *)arg;
+    long long start;
+    char *msg;
+    int ret, i = 0;
+
+    while(!stop){
+        msg = messages[i++ % NUM_MESSAGES];
+        start = monotonic_ns();
+        ret = put_data(msg, strlen(msg) + 1);
+        if(ret < 0){
+            if(errno != ENOMEM){
+                __sync_fetch_and_add(&total_errors, 1);
+            }
+            continue;
+        }
+        if(samples->count < MAX_SAMPLES)
+            samples->ns[samples->count++] = monotonic_ns() - start;
+        if(invalidate_data(ret) < 0 && errno != ENODATA){
+            __sync_fetch_and_add(&total_errors, 1);
+        }
+    }
+    return NULL;
+}
+
+int cmp_ll(const void *a, const void *b){
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+* put_data() throughput and latency distribution, with a single writer and with 16 concurrent writers
+*/
+void bench_latency(void){
+    int nthreads[] = {1, 16};
+    struct latency_samples samples[16];
+    pthread_t tids[16];
+    long long *all;
+    unsigned long total;
+    int n, i;
+
+    print_color_bold(YELLOW);
+    printf("put_data() latency (%d seconds per run)\n", RUN_SECONDS);
+    reset_color();
+    printf("%8s %14s %14s %14s\n", "writers", "puts/s", "p50 us", "p99 us");
+
+    for(n=0; n < 2; n++){
+        stop = 0;
+        for(i=0; i < nthreads[n]; i++){
+            samples[i].ns = malloc(MAX_SAMPLES * sizeof(long long));
+            samples[i].count = 0;
+            if(!samples[i].ns){
+                total_errors++;
+                return;
+            }
+            pthread_create(&tids[i], NULL, latency_writer, &samples[i]);
+        }
+        sleep(RUN_SECONDS);
+        stop = 1;
+
+        total = 0;
+        for(i=0; i < nthreads[n]; i++){
+            pthread_join(tids[i], NULL);
+            total += samples[i].count;
+        }
+
+        all = malloc((total + 1) * sizeof(long long));
+        if(!all){
+            total_errors++;
+            return;
+        }
+        total = 0;
+        for(i=0; i < nthreads[n]; i++){
+            memcpy(all + total, samples[i].ns, samples[i].count * sizeof(long long));
+            total += samples[i].count;
+            free(samples[i].ns);
+        }
+        qsort(all, total, sizeof(long long), cmp_ll);
+
+        if(total > 0)
+            printf("%8d %14lu %14.1f %14.1f\n", nthreads[n], total / RUN_SECONDS, all[total / 2] / 1e3, all[(total * 99) / 100] / 1e3);
+        else
+            printf("%8d %14d %14s %14s\n", nthreads[n], 0, "-", "-");
+        fflush(stdout);
+        free(all);
+    }
+}
+
+
+/*
+* Messages per second written by a single thread, one put_data() each or BATCH_SIZE per put_data_batch();
+* all the written blocks are invalidated, so that the device never fills up
+*/
+void bench_batch(void){
+    struct bldms_put_desc descs[BATCH_SIZE];
+    long results[BATCH_SIZE];
+    unsigned long msgs;
+    long long start, elapsed;
+    double single = 0, rate;
+    int batched, ret, i;
+
+    print_color_bold(YELLOW);
+    printf("put_data_batch() throughput (%d seconds per run, %d messages per batch)\n", RUN_SECONDS, BATCH_SIZE);
+    reset_color();
+    if(put_data_batch_nr == 0){
+        printf("skipped: PUT_DATA_BATCH_NR is not set\n");
+        return;
+    }
+    printf("%16s %14s %10s\n", "system call", "msgs/s", "speedup");
+
+    for(i=0; i < BATCH_SIZE; i++){
+        descs[i].source = messages[i % NUM_MESSAGES];
+        descs[i].size = strlen(descs[i].source) + 1;
+    }
+
+    for(batched = 0; batched < 2; batched++){
+        msgs = 0;
+        start = monotonic_ns();
+        do{
+            if(!batched){
+                ret = put_data(descs[0].source, descs[0].size);
+                if(ret < 0){
+                    if(errno != ENOMEM)
+                        total_errors++;
+                    continue;
+                }
+                msgs++;
+                if(invalidate_data(ret) < 0)
+                    total_errors++;
+                continue;
+            }
+            ret = put_data_batch(0, descs, BATCH_SIZE, results);
+            if(ret < 0){
+                total_errors++;
+                break;
+            }
+            msgs += ret;
+            for(i=0; i < BATCH_SIZE; i++){
+                if(results[i] < 0){
+                    if(results[i] != -ENOMEM)
+                        total_errors++;
+                }else if(invalidate_data(results[i]) < 0){
+                    total_errors++;
+                }
+            }
+        }while(monotonic_ns() - start < RUN_SECONDS * 1000000000LL);
+        elapsed = monotonic_ns() - start;
+
+        rate = msgs * 1e9 / elapsed;
+        if(!batched)
+            single = rate;
+        printf("%16s %14.0f %9.2fx\n", batched ? "put_data_batch" : "put_data", rate, (single > 0) ? rate / single : 0.0);
+        fflush(stdout);
+    }
+}
+
+
+struct benchmark {
+    const char *name;
+    void (*run)(void);
+};
+
+struct benchmark benchmarks[] = {
+    {"scalability", bench_scalability},
+    {"invalidate", bench_invalidate},
+    {"churn", bench_churn},
+    {"putcost", bench_putcost},
+    {"latency", bench_latency},
+    {"batch", bench_batch},
+};
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks)/sizeof(struct benchmark))
+
+
+int main(int argc, char **argv){
+    int fd, i, j, selected;
+    struct stat st;
+
+    if(argc < 5){
+        printf("Usage:\n\t./%s <device file path> <put_data() NR> <get_data() NR> <invalidate_data() NR> [benchmark ...]\n\n", argv[0]);
+        exit(1);
+    }
+
+    // save device file location and system call numbers
+    device_filepath = argv[1];
+    put_data_nr = atol(argv[2]);
+    get_data_nr = atol(argv[3]);
+    invalidate_data_nr = atol(argv[4]);
+    if(getenv("PUT_DATA_BATCH_NR"))
+        put_data_batch_nr = atol(getenv("PUT_DATA_BATCH_NR"));
+
+    fd = open(device_filepath, O_RDONLY);
+    if(fd < 0){
+        print_color(RED);
+        printf("Error: unable to open device as a file\n");
+        reset_color();
+        exit(1);
+    }
+    fstat(fd, &st);
+    num_blocks = st.st_size / BLK_SIZE;
+    close(fd);
+    printf("Device has %ld blocks\n\n", num_blocks);
+
+    for(i=0; i < NUM_BENCHMARKS; i++){
+        selected = (argc == 5);
+        for(j=5; j < argc; j++){
+            if(!strcmp(argv[j], benchmarks[i].name))
+                selected = 1;
+        }
+        if(selected){
+            benchmarks[i].run();
+            printf("\n");
+        }
+    }
+
+    if(total_errors != 0){
+        print_color_bold(RED);
+        printf("%d unexpected errors have been reported\n", total_errors);
+        reset_color();
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Mount time of a device that was not cleanly unmounted, i.e. whose index has to be rebuilt by reading the headers
+# of its blocks, with 1, 2, 4, ... scanning workers up to the number of online CPUs. The module must be loaded and
+# the program must be run with root privileges. A module without the scan_workers parameter (i.e. built before the
+# parallel scan) is measured once per run, so that the same script gives the times before and after it.
+#
+# Usage: ./bench_mount.sh <formatter> <number of blocks> [runs per configuration]
+#
+
+FORMATTER=$1
+NR_BLOCKS=$2
+RUNS=${3:-3}
+PARAM=/sys/module/the_bldms/parameters/scan_workers
+
+if [ -z "$FORMATTER" ] || [ -z "$NR_BLOCKS" ]; then
+    echo "Usage: $0 <formatter> <number of blocks> [runs per configuration]"
+    exit 1
+fi
+if [ ! -d /sys/module/the_bldms ] || [ "$(id -u)" -ne 0 ]; then
+    echo "The module is not loaded, or the program is not run with root privileges"
+    exit 1
+fi
+if [ -e $PARAM ]; then
+    old_workers=$(cat $PARAM)
+    max_workers=$(nproc)
+else
+    max_workers=1
+fi
+
+WORKDIR=$(mktemp -d /tmp/bldms_bench_mount.XXXXXX)
+cleanup(){
+    umount $WORKDIR/mount 2>/dev/null
+    rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+# the formatted image is kept aside: every mount starts from a copy of it, since the unmount saves the checkpoint
+dd bs=4096 count=0 seek=$NR_BLOCKS of=$WORKDIR/image.orig 2>/dev/null
+$FORMATTER $WORKDIR/image.orig > /dev/null || exit 1
+mkdir $WORKDIR/mount
+
+printf "%8s %8s %12s %12s\n" "workers" "run" "mount_us" "scan_us"
+
+workers=1
+while [ $workers -le $max_workers ]; do
+    [ -e $PARAM ] && echo $workers > $PARAM
+    run=1
+    while [ $run -le $RUNS ]; do
+        cp --sparse=always $WORKDIR/image.orig $WORKDIR/image
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+
+        start=$(date +%s%N)
+        mount -o loop -t bldms_fs $WORKDIR/image $WORKDIR/mount || exit 1
+        end=$(date +%s%N)
+        scan_us=$(dmesg | grep "headers of .* blocks read by" | tail -n 1 | sed 's/.* in \([0-9]*\) us.*/\1/')
+        umount $WORKDIR/mount
+
+        printf "%8d %8d %12d %12s\n" $workers $run $(( (end - start) / 1000 )) "$scan_us"
+        run=$((run + 1))
+    done
+    workers=$((workers * 2))
+done
+
+[ -e $PARAM ] && echo $old_workers > $PARAM
@@ -16,6 +16,8 @@
  *
  * @file test.c
  * @brief Basic testing program for the BLDMS block device driver.
+ * If it is run with root privileges, it also checks that filling a device whose blocks are not cached
+ * does not issue any read operation on the block device.
  * 
  * @author Andrea Pepe
  * @date April 22, 2023  
@@ -26,6 +28,7 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,6 +38,7 @@
 #define BLOCK_SIZE (1<<12)
 #define METADATA_SIZE (sizeof(signed long long) + sizeof(uint16_t))
 #define MAX_MSG_SIZE (BLOCK_SIZE - METADATA_SIZE)
+#define DROP_CACHES_PATH "/proc/sys/vm/drop_caches"
 
 long put_data_nr = 0x0;
 long get_data_nr = 0x0;
@@ -47,16 +51,51 @@ size_t num_blocks = 0;
             syscall(put_data_nr, source, size)
 
 #define get_data(offset, destination, size) \
-            syscall(get_data_nr, offset, destination, size)
+            syscall(get_data_nr, (long)(offset), destination, size)
 
 #define invalidate_data(offset) \
-            syscall(invalidate_data_nr, offset)
+            syscall(invalidate_data_nr, (long)(offset))
+
+
+/*
+* Number of read operations completed by the block device, as reported in /sys/dev/block/<major>:<minor>/stat;
+* -1 if it is not available
+*/
+long read_io_count(dev_t dev){
+    char path[64];
+    long reads = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/stat", major(dev), minor(dev));
+    f = fopen(path, "r");
+    if(!f)
+        return -1;
+    if(fscanf(f, "%ld", &reads) != 1)
+        reads = -1;
+    fclose(f);
+    return reads;
+}
+
+/*
+* Write back and drop the clean cached blocks, so that they are not in memory anymore; 0 on success
+*/
+int drop_caches(void){
+    FILE *f;
+
+    sync();
+    f = fopen(DROP_CACHES_PATH, "w");
+    if(!f)
+        return -1;
+    fputs("3", f);
+    return fclose(f);
+}
 
 
 int main(int argc, char **argv){
     int i, fd, ret;
     struct stat st;
     char *msg;
+    long reads_before = -1, reads_after;
 
     if(argc < 5){
         printf("Usage:\n\t./%s <device file path> <put_data() NR> <get_data() NR> <invalidate_data() NR>\n\n", argv[0]);
@@ -102,6 +141,16 @@ int main(int argc, char **argv){
     printf("All the messages on the device have been correctly invalidated.\n");
     reset_color();
 
+    // the device is filled starting from a cold cache, to count the reads issued by put_data()
+    if(drop_caches() == 0){
+        reads_before = read_io_count(st.st_dev);
+    }
+    if(reads_before < 0){
+        print_color(YELLOW);
+        printf("Unable to drop the caches or to read the block device statistics: the read count check will be skipped\n");
+        reset_color();
+    }
+
     // fill the device with messages and check that another put_data result in an error with errno set to ENOMEM
     for (i=0; i < num_blocks; i++){
         msg = messages[i % NUM_MESSAGES];
@@ -115,6 +164,20 @@ int main(int argc, char **argv){
         }
     }
 
+    if(reads_before >= 0){
+        reads_after = read_io_count(st.st_dev);
+        if(reads_after != reads_before){
+            // put_data() should never read the blocks it is going to overwrite
+            print_color_bold(RED);
+            printf("\nput_data() was expected to issue no read on an uncached device, but %ld reads have been issued\n", reads_after - reads_before);
+            reset_color();
+            exit(1);
+        }
+        print_color(GREEN);
+        printf("Filling the uncached device issued no read operation, as expected.\n");
+        reset_color();
+    }
+
     print_color_bold(YELLOW);
     printf("The device has been filled with messages. Trying to add another message ...\n");
     reset_color();
@@ -0,0 +1,298 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file test_batch.c
+ * @brief Testing program for the put_data_batch() system call of the BLDMS block device driver: every message
+ * written by a batch is read back through get_data(), and the messages that fail in the middle of a batch, because
+ * of a bad buffer or of a full device, must not affect the other ones. The device of id 0 is filled during the test,
+ * then all the messages written by the test are invalidated; it needs at least 16 free blocks.
+ *
+ * @author Andrea Pepe
+ * @date April 22, 2023
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "include/pretty-print.h"
+
+#define BLOCK_SIZE (1<<12)
+#define METADATA_SIZE (sizeof(signed long long) + sizeof(uint16_t))
+#define MAX_MSG_SIZE (BLOCK_SIZE - METADATA_SIZE)
+#define MAX_BATCH 64                    // maximum number of messages of a put_data_batch() (BLDMS_MAX_BATCH)
+#define NUM_MSGS 16                     // messages of the first batch
+#define NUM_FREED 8                     // blocks freed on the full device for the batch with bad buffers
+#define FULL_BATCH 5                    // messages of the batch on a device with FULL_FREED free blocks
+#define FULL_FREED 3
+
+long put_data_nr = 0x0;
+long get_data_nr = 0x0;
+long invalidate_data_nr = 0x0;
+long put_data_batch_nr = 0x0;
+char *device_filepath;
+size_t num_blocks = 0;
+
+// declaration of macros for calling the system calls
+#define put_data(source, size) \
+            syscall(put_data_nr, source, size)
+
+#define get_data(offset, destination, size) \
+            syscall(get_data_nr, (long)(offset), destination, size)
+
+#define invalidate_data(offset) \
+            syscall(invalidate_data_nr, (long)(offset))
+
+#define put_data_batch(dev, descs, n, results) \
+            syscall(put_data_batch_nr, dev, descs, n, results)
+
+// descriptor of a message of put_data_batch(), as defined by the module
+struct bldms_put_desc {
+    char *source;
+    size_t size;
+};
+
+struct bldms_put_desc descs[MAX_BATCH + 1];
+long results[MAX_BATCH + 1];
+char msgs[MAX_BATCH + 1][128];
+char buffer[BLOCK_SIZE];
+
+long *written;                          // blocks written by the test, invalidated at the end
+size_t nr_written = 0;
+
+
+/*
+* Print the reason of the failure of the test and exit with an error
+*/
+void fail(const char *fmt, ...){
+    va_list args;
+
+    print_color_bold(RED);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    reset_color();
+    exit(1);
+}
+
+
+/*
+* Set the i-th descriptor to a message that is different from all the other ones written by the test
+*/
+void set_msg(int i){
+    static int id = 0;
+
+    snprintf(msgs[i], sizeof(msgs[i]), "Message %d of the put_data_batch() test\n", id++);
+    descs[i].source = msgs[i];
+    descs[i].size = strlen(msgs[i]) + 1;
+}
+
+
+/*
+* Check that the message of the i-th descriptor is in the block returned for it, and remember the block
+*/
+void check_written(int i){
+    long ret;
+
+    if(results[i] < 0)
+        fail("\nMessage %d of the batch was expected to be written, but got error %ld\n", i, results[i]);
+    ret = get_data(results[i], buffer, MAX_MSG_SIZE);
+    if(ret != (long)descs[i].size)
+        fail("\nget_data() of block %ld, written by message %d of the batch, returned %ld instead of %zu\n", results[i], i, ret, descs[i].size);
+    if(memcmp(buffer, descs[i].source, descs[i].size) != 0)
+        fail("\nBlock %ld does not keep message %d of the batch\n", results[i], i);
+    written[nr_written++] = results[i];
+}
+
+
+/*
+* Write messages with put_data() until the device is full
+* @retval the number of messages written
+*/
+long fill_device(void){
+    long ret, n = 0;
+
+    set_msg(0);
+    while((ret = put_data(descs[0].source, descs[0].size)) >= 0){
+        written[nr_written++] = ret;
+        n++;
+    }
+    if(errno != ENOMEM)
+        fail("\nput_data() called to fill the device failed with errno %d instead of ENOMEM\n", errno);
+    return n;
+}
+
+
+int main(int argc, char **argv){
+    struct stat st;
+    long ret, freed[FULL_FREED];
+    char *page;
+    int i, j, fd;
+
+    if(argc < 6){
+        printf("Usage:\n\t./%s <device file path> <put_data() NR> <get_data() NR> <invalidate_data() NR> <put_data_batch() NR>\n\n", argv[0]);
+        exit(1);
+    }
+
+    print_color_bold(YELLOW);
+    printf("Initializing ...\n");
+    reset_color();
+
+    // save device file location and system call numbers
+    device_filepath = argv[1];
+    put_data_nr = atol(argv[2]);
+    get_data_nr = atol(argv[3]);
+    invalidate_data_nr = atol(argv[4]);
+    put_data_batch_nr = atol(argv[5]);
+
+    fd = open(device_filepath, O_RDONLY);
+    if (fd < 0)
+        fail("Unable to call open on the specified path %s\n", device_filepath);
+    fstat(fd, &st);
+    num_blocks = st.st_size / BLOCK_SIZE;
+    close(fd);
+
+    written = malloc((num_blocks + MAX_BATCH) * sizeof(long));
+    if(!written)
+        fail("Unable to allocate memory\n");
+
+    // a batch of valid messages: all of them are written, each one in a different block
+    for (i = 0; i < NUM_MSGS; i++)
+        set_msg(i);
+    ret = put_data_batch(0, descs, NUM_MSGS, results);
+    if(ret != NUM_MSGS)
+        fail("\nput_data_batch() of %d messages returned %ld (errno %d)\n", NUM_MSGS, ret, (ret < 0) ? errno : 0);
+    for (i = 0; i < NUM_MSGS; i++){
+        check_written(i);
+        for (j = 0; j < i; j++){
+            if(results[j] == results[i])
+                fail("\nMessages %d and %d of the batch were written in the same block %ld\n", j, i, results[i]);
+        }
+    }
+
+    print_color(GREEN);
+    printf("put_data_batch() wrote %d messages, each one readable through get_data() in the block returned for it.\n", NUM_MSGS);
+    reset_color();
+
+    print_color_bold(YELLOW);
+    printf("\nFilling the device, then freeing %d blocks for a batch with bad messages ...\n", NUM_FREED);
+    reset_color();
+
+    fill_device();
+    for (i = 0; i < NUM_FREED; i++){
+        if(invalidate_data(written[--nr_written]) < 0)
+            fail("\ninvalidate_data() failed with errno %d\n", errno);
+    }
+
+    /*
+    * Messages that can not be read from user space are in the middle of the batch: one whose buffer is not mapped
+    * at all, and one whose buffer crosses into an unmapped page, so that it is only partially copied.
+    * Another one is too big. The messages around them must be written anyway.
+    */
+    page = mmap(NULL, 2 * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(page == MAP_FAILED || munmap(page + BLOCK_SIZE, BLOCK_SIZE) < 0)
+        fail("Unable to map the buffers of the test\n");
+    memset(page, 'C', BLOCK_SIZE);
+
+    for (i = 0; i < 6; i++)
+        set_msg(i);
+    descs[1].source = page + BLOCK_SIZE;
+    descs[3].size = MAX_MSG_SIZE + 1;
+    descs[4].source = page + BLOCK_SIZE - 16;
+    descs[4].size = 64;
+
+    ret = put_data_batch(0, descs, 6, results);
+    if(ret != 3)
+        fail("\nput_data_batch() was expected to write 3 of its 6 messages, but returned %ld (errno %d)\n", ret, (ret < 0) ? errno : 0);
+    if(results[1] != -EMSGSIZE || results[4] != -EMSGSIZE)
+        fail("\nEMSGSIZE was expected for the messages with bad buffers, but %ld and %ld were returned\n", results[1], results[4]);
+    if(results[3] != -E2BIG)
+        fail("\nE2BIG was expected for the message too big, but %ld was returned\n", results[3]);
+    check_written(0);
+    check_written(2);
+    check_written(5);
+
+    // the blocks reserved for the failed messages are free again
+    ret = fill_device();
+    if(ret != NUM_FREED - 3)
+        fail("\n%d blocks were expected to be free after the batch, but %ld messages have been written\n", NUM_FREED - 3, ret);
+
+    print_color(GREEN);
+    printf("put_data_batch() set EMSGSIZE and E2BIG for the bad messages, wrote the other ones and gave the unused blocks back.\n");
+    reset_color();
+
+    print_color_bold(YELLOW);
+    printf("\nFreeing %d blocks of the full device for a batch of %d messages ...\n", FULL_FREED, FULL_BATCH);
+    reset_color();
+
+    for (i = 0; i < FULL_FREED; i++){
+        freed[i] = written[--nr_written];
+        if(invalidate_data(freed[i]) < 0)
+            fail("\ninvalidate_data() failed with errno %d\n", errno);
+    }
+    for (i = 0; i < FULL_BATCH; i++)
+        set_msg(i);
+    ret = put_data_batch(0, descs, FULL_BATCH, results);
+    if(ret != FULL_FREED)
+        fail("\nput_data_batch() was expected to write %d messages, but returned %ld (errno %d)\n", FULL_FREED, ret, (ret < 0) ? errno : 0);
+    for (i = 0; i < FULL_BATCH; i++){
+        if(i >= FULL_FREED){
+            if(results[i] != -ENOMEM)
+                fail("\nENOMEM was expected for message %d, but %ld was returned\n", i, results[i]);
+            continue;
+        }
+        check_written(i);
+        for (j = 0; j < FULL_FREED && freed[j] != results[i]; j++);
+        if(j == FULL_FREED)
+            fail("\nMessage %d was written in block %ld, which was not free\n", i, results[i]);
+    }
+
+    print_color(GREEN);
+    printf("put_data_batch() wrote %d messages in the free blocks and set ENOMEM for the other ones, as expected.\n", FULL_FREED);
+    reset_color();
+
+    print_color_bold(YELLOW);
+    printf("\nChecking the arguments of the batch ...\n");
+    reset_color();
+
+    ret = put_data_batch(0, descs, 0, results);
+    if(!(ret < 0 && errno == EINVAL))
+        fail("\nEINVAL was expected for 0 messages, but put_data_batch() returned %ld (errno %d)\n", ret, errno);
+    ret = put_data_batch(0, descs, MAX_BATCH + 1, results);
+    if(!(ret < 0 && errno == EINVAL))
+        fail("\nEINVAL was expected for %d messages, but put_data_batch() returned %ld (errno %d)\n", MAX_BATCH + 1, ret, errno);
+    ret = put_data_batch(0, page + BLOCK_SIZE, 1, results);
+    if(!(ret < 0 && errno == EFAULT))
+        fail("\nEFAULT was expected for unreadable descriptors, but put_data_batch() returned %ld (errno %d)\n", ret, errno);
+
+    print_color(GREEN);
+    printf("put_data_batch() set errno to EINVAL for 0 and %d messages and to EFAULT for bad descriptors, as expected.\n", MAX_BATCH + 1);
+    reset_color();
+
+    // the device is left as it was
+    while(nr_written > 0){
+        if(invalidate_data(written[--nr_written]) < 0)
+            fail("\ninvalidate_data() of block %ld failed with errno %d\n", written[nr_written], errno);
+    }
+
+    return 0;
+}
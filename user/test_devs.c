@@ -0,0 +1,443 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file test_devs.c
+ * @brief Testing program for several BLDMS devices mounted at the same time: the _dev system calls must work on the
+ * device whose id they are given, and nothing written on a device must be visible on the other one. In group durability
+ * mode, threads write on both devices at the same time: each device has its own group commit, so all the messages must
+ * be written on their own device, and the writers of a device must not slow down the ones of the other. Then, the second
+ * device is unmounted while some threads keep on using it: the system calls in progress must complete normally,
+ * and the ones issued after the unmount must fail with ENODEV. It must be run with root privileges, on two freshly
+ * formatted devices (see test_devs.sh).
+ *
+ * @author Andrea Pepe
+ * @date April 22, 2023
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mount.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "include/pretty-print.h"
+
+#define BLK_SIZE (1<<12)
+#define METADATA_SIZE (sizeof(signed long long) + sizeof(uint16_t))
+#define MAX_MSG_SIZE (BLK_SIZE - METADATA_SIZE)
+#define MAX_DEVS 64                     // number of device ids (BLDMS_MAX_DEVS)
+#define DEVICES_PATH "/sys/fs/bldms_fs/devices"
+#define DURABILITY_PATH "/sys/fs/bldms_fs/durability"
+#define NUM_MSGS 8                      // messages written on each device
+#define RACE_THREADS 8                  // threads using the device while it is unmounted
+#define RACE_DELAY_US 200000            // time the threads use the device before the unmount
+#define GROUP_THREADS 8                 // writers of each device in group mode
+#define GROUP_MSGS 16                   // messages written by each of them
+
+long put_data_dev_nr = 0x0;
+long get_data_dev_nr = 0x0;
+long invalidate_data_dev_nr = 0x0;
+
+// declaration of macros for calling the system calls
+#define put_data_dev(dev, source, size) \
+            syscall(put_data_dev_nr, dev, source, size)
+
+#define get_data_dev(dev, offset, destination, size) \
+            syscall(get_data_dev_nr, dev, (long)(offset), destination, size)
+
+#define invalidate_data_dev(dev, offset) \
+            syscall(invalidate_data_dev_nr, dev, (long)(offset))
+
+int race_dev;
+volatile int unmounted = 0;             // set once the unmount of race_dev has returned
+int race_errors = 0;
+
+struct group_writer {
+    pthread_t tid;
+    int dev;
+    int n;                              // index of the writer on its device
+    long blocks[GROUP_MSGS];
+    int error;                          // errno of the first failed put_data_dev(), 0 if none
+};
+
+
+/*
+* Print the reason of the failure of the test and exit with an error
+*/
+void fail(const char *fmt, ...){
+    va_list args;
+
+    print_color_bold(RED);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    reset_color();
+    exit(1);
+}
+
+
+/*
+* Id of the BLDMS device mounted on "mount_point", looked up by its block device in the list of the mounted devices
+* @retval the id, -1 if the device is not listed
+*/
+int device_id(const char *mount_point){
+    char name[64], path[128];
+    unsigned int maj, min;
+    unsigned long nblocks;
+    struct stat st;
+    FILE *devs, *f;
+    int id, found = -1;
+
+    if(stat(mount_point, &st) < 0)
+        return -1;
+    devs = fopen(DEVICES_PATH, "r");
+    if(!devs)
+        return -1;
+    while(found < 0 && fscanf(devs, "%d %63s %lu", &id, name, &nblocks) == 3){
+        snprintf(path, sizeof(path), "/sys/class/block/%s/dev", name);
+        f = fopen(path, "r");
+        if(!f)
+            continue;
+        if(fscanf(f, "%u:%u", &maj, &min) == 2 && maj == major(st.st_dev) && min == minor(st.st_dev))
+            found = id;
+        fclose(f);
+    }
+    fclose(devs);
+    return found;
+}
+
+
+/*
+* Check if a device of id "id" is listed among the mounted ones
+*/
+int id_mounted(int id){
+    char name[64];
+    unsigned long nblocks;
+    FILE *devs;
+    int curr, found = 0;
+
+    devs = fopen(DEVICES_PATH, "r");
+    if(!devs)
+        return 0;
+    while(!found && fscanf(devs, "%d %63s %lu", &curr, name, &nblocks) == 3)
+        found = (curr == id);
+    fclose(devs);
+    return found;
+}
+
+
+/*
+* Read the block "offset" of the device "dev" and check that it keeps "msg"
+*/
+void check_message(int dev, long offset, const char *msg){
+    char buffer[BLK_SIZE];
+    long ret;
+
+    ret = get_data_dev(dev, offset, buffer, MAX_MSG_SIZE);
+    if(ret != (long)strlen(msg) + 1 || memcmp(buffer, msg, ret) != 0)
+        fail("\nBlock %ld of device %d does not keep the message written on it (get_data_dev() returned %ld, errno %d)\n", offset, dev, ret, (ret < 0) ? errno : 0);
+}
+
+
+/*
+* Check that the block "offset" of the device "dev" does not keep "msg", written on another device
+*/
+void check_not_visible(int dev, long offset, const char *msg){
+    char buffer[BLK_SIZE];
+    long ret;
+
+    ret = get_data_dev(dev, offset, buffer, MAX_MSG_SIZE);
+    if(ret < 0 && errno != ENODATA)
+        fail("\nget_data_dev() on block %ld of device %d failed with errno %d\n", offset, dev, errno);
+    if(ret >= 0 && ret == (long)strlen(msg) + 1 && memcmp(buffer, msg, ret) == 0)
+        fail("\nThe message written in block %ld of another device is visible on device %d\n", offset, dev);
+}
+
+
+/*
+* Read the current durability mode, listed between square brackets, into "mode"
+*/
+void get_durability(char *mode, size_t size){
+    char buf[128], *start, *end;
+    FILE *f;
+
+    f = fopen(DURABILITY_PATH, "r");
+    if(!f || !fgets(buf, sizeof(buf), f))
+        fail("Unable to read %s\n", DURABILITY_PATH);
+    fclose(f);
+    start = strchr(buf, '[');
+    end = start ? strchr(start, ']') : NULL;
+    if(!end)
+        fail("No current durability mode in %s\n", DURABILITY_PATH);
+    *end = '\0';
+    snprintf(mode, size, "%s", start + 1);
+}
+
+
+void set_durability(const char *mode){
+    FILE *f;
+
+    f = fopen(DURABILITY_PATH, "w");
+    if(!f || fputs(mode, f) < 0 || fclose(f) != 0)
+        fail("Unable to set the durability mode %s (errno %d)\n", mode, errno);
+}
+
+
+/*
+* Writer of a device in group mode: its messages are different from the ones of all the other writers
+*/
+void *group_worker(void *arg){
+    struct group_writer *w = arg;
+    char msg[64];
+    int i;
+
+    for (i = 0; i < GROUP_MSGS; i++){
+        snprintf(msg, sizeof(msg), "Message %d of writer %d of device %d\n", i, w->n, w->dev);
+        w->blocks[i] = put_data_dev(w->dev, msg, strlen(msg) + 1);
+        if(w->blocks[i] < 0){
+            w->error = errno;
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+* Run GROUP_THREADS writers on each of the "nr_devs" devices at the same time, check their messages and invalidate them
+* @retval the average time of a put_data_dev(), in microseconds
+*/
+double group_writes(int *ids, int nr_devs){
+    struct group_writer writers[2][GROUP_THREADS];
+    struct timespec start, end;
+    char msg[64];
+    double elapsed;
+    int d, t, i;
+
+    memset(writers, 0, sizeof(writers));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (d = 0; d < nr_devs; d++){
+        for (t = 0; t < GROUP_THREADS; t++){
+            writers[d][t].dev = ids[d];
+            writers[d][t].n = t;
+            if(pthread_create(&writers[d][t].tid, NULL, group_worker, &writers[d][t]) != 0)
+                fail("Unable to create the threads\n");
+        }
+    }
+    for (d = 0; d < nr_devs; d++){
+        for (t = 0; t < GROUP_THREADS; t++)
+            pthread_join(writers[d][t].tid, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+
+    for (d = 0; d < nr_devs; d++){
+        for (t = 0; t < GROUP_THREADS; t++){
+            if(writers[d][t].error)
+                fail("\nput_data_dev() on device %d failed with errno %d in group mode\n", ids[d], writers[d][t].error);
+            for (i = 0; i < GROUP_MSGS; i++){
+                snprintf(msg, sizeof(msg), "Message %d of writer %d of device %d\n", i, t, ids[d]);
+                check_message(ids[d], writers[d][t].blocks[i], msg);
+                if(invalidate_data_dev(ids[d], writers[d][t].blocks[i]) < 0)
+                    fail("\ninvalidate_data_dev() on device %d failed with errno %d\n", ids[d], errno);
+            }
+        }
+    }
+    // the writers run together, and each one issues its writes one after the other
+    return elapsed / GROUP_MSGS;
+}
+
+
+/*
+* Check the outcome of a system call of a racing thread: after the unmount, only ENODEV is allowed
+*/
+int race_check(long ret, int after_unmount, int allowed_errno){
+    if(ret >= 0 && !after_unmount)
+        return 0;
+    if(ret < 0 && errno == ENODEV)
+        return 1;
+    if(ret < 0 && errno == allowed_errno && !after_unmount)
+        return 0;
+    __sync_fetch_and_add(&race_errors, 1);
+    return 1;
+}
+
+
+/*
+* Racing thread: put, get and invalidate messages on race_dev until it is unmounted
+*/
+void *race_worker(void *arg){
+    char msg[64], buffer[BLK_SIZE];
+    long ret, n;
+    int after;
+
+    snprintf(msg, sizeof(msg), "Message of racing thread %ld\n", (long)arg);
+    for(;;){
+        after = unmounted;
+        ret = put_data_dev(race_dev, msg, strlen(msg) + 1);
+        if(race_check(ret, after, ENOMEM)){
+            if(after)
+                break;
+            continue;
+        }
+        if(ret < 0)
+            continue;
+
+        after = unmounted;
+        n = get_data_dev(race_dev, ret, buffer, MAX_MSG_SIZE);
+        if(race_check(n, after, 0)){
+            if(after)
+                break;
+            continue;
+        }
+        if(n != (long)strlen(msg) + 1 || memcmp(buffer, msg, n) != 0)
+            __sync_fetch_and_add(&race_errors, 1);
+
+        after = unmounted;
+        if(race_check(invalidate_data_dev(race_dev, ret), after, 0) && after)
+            break;
+    }
+    return NULL;
+}
+
+
+int main(int argc, char **argv){
+    char msgs[2][NUM_MSGS][64];
+    long blocks[2][NUM_MSGS];
+    int ids[2], i, d;
+    char buffer[BLK_SIZE], mode[32];
+    pthread_t tids[RACE_THREADS];
+    double single_us, both_us;
+    long ret;
+
+    if(argc < 6){
+        printf("Usage:\n\t./%s <mount point of device A> <mount point of device B> <put_data_dev() NR> <get_data_dev() NR> <invalidate_data_dev() NR>\n\n", argv[0]);
+        exit(1);
+    }
+
+    put_data_dev_nr = atol(argv[3]);
+    get_data_dev_nr = atol(argv[4]);
+    invalidate_data_dev_nr = atol(argv[5]);
+
+    for (d = 0; d < 2; d++){
+        ids[d] = device_id(argv[1 + d]);
+        if(ids[d] < 0)
+            fail("No BLDMS device is listed in %s for the mount point %s\n", DEVICES_PATH, argv[1 + d]);
+    }
+    if(ids[0] == ids[1])
+        fail("The two mount points have the same device id %d\n", ids[0]);
+
+    print_color_bold(YELLOW);
+    printf("Devices %d and %d are mounted. Writing %d messages on each of them ...\n", ids[0], ids[1], NUM_MSGS);
+    reset_color();
+
+    /*
+    * Both devices are empty, so their messages are written in blocks with the same indexes:
+    * reading an index on the wrong device would give the message of the other one.
+    */
+    for (i = 0; i < NUM_MSGS; i++){
+        for (d = 0; d < 2; d++){
+            snprintf(msgs[d][i], sizeof(msgs[d][i]), "Message %d of device %d\n", i, ids[d]);
+            blocks[d][i] = put_data_dev(ids[d], msgs[d][i], strlen(msgs[d][i]) + 1);
+            if(blocks[d][i] < 0)
+                fail("\nput_data_dev() on device %d failed with errno %d\n", ids[d], errno);
+        }
+    }
+    for (i = 0; i < NUM_MSGS; i++){
+        for (d = 0; d < 2; d++){
+            check_message(ids[d], blocks[d][i], msgs[d][i]);
+            check_not_visible(ids[1 - d], blocks[d][i], msgs[d][i]);
+        }
+    }
+
+    // an invalidation only affects its own device
+    if(invalidate_data_dev(ids[0], blocks[0][0]) < 0)
+        fail("\ninvalidate_data_dev() on device %d failed with errno %d\n", ids[0], errno);
+    ret = get_data_dev(ids[0], blocks[0][0], buffer, MAX_MSG_SIZE);
+    if(!(ret < 0 && errno == ENODATA))
+        fail("\nENODATA was expected for the invalidated block, but get_data_dev() returned %ld\n", ret);
+    check_message(ids[1], blocks[1][0], msgs[1][0]);
+
+    print_color(GREEN);
+    printf("Each device only sees its own messages and invalidations.\n");
+    reset_color();
+
+    // ids with no mounted device
+    for (d = 0; d < MAX_DEVS && id_mounted(d); d++);
+    if(d == MAX_DEVS)
+        fail("\nAll the device ids are in use\n");
+    if(!(put_data_dev(d, msgs[0][0], 10) < 0 && errno == ENODEV) || !(get_data_dev(-1, 0, buffer, 10) < 0 && errno == ENODEV) ||
+            !(invalidate_data_dev(MAX_DEVS, 0) < 0 && errno == ENODEV))
+        fail("\nENODEV was expected for the ids of devices that are not mounted\n");
+
+    print_color(GREEN);
+    printf("The ids of devices that are not mounted are refused with ENODEV.\n");
+    reset_color();
+
+    print_color_bold(YELLOW);
+    printf("\nWriting on one device, then on both devices at the same time, in group mode with %d writers per device ...\n", GROUP_THREADS);
+    reset_color();
+
+    get_durability(mode, sizeof(mode));
+    set_durability("group");
+    single_us = group_writes(ids, 1);
+    both_us = group_writes(ids, 2);
+    set_durability(mode);
+
+    print_color(GREEN);
+    printf("All the messages written in group mode are on their own device: a write took %.0f us on one device, %.0f us on two devices.\n", single_us, both_us);
+    reset_color();
+    if(both_us > 2 * single_us)
+        printf("WARNING: the writes on two devices are much slower than on one device: the writers of the devices may not be batched separately\n");
+
+    print_color_bold(YELLOW);
+    printf("\nUnmounting device %d while %d threads are using it ...\n", ids[1], RACE_THREADS);
+    reset_color();
+
+    race_dev = ids[1];
+    for (i = 0; i < RACE_THREADS; i++){
+        if(pthread_create(&tids[i], NULL, race_worker, (void *)(long)i) != 0)
+            fail("Unable to create the threads\n");
+    }
+    usleep(RACE_DELAY_US);
+    if(umount(argv[2]) < 0)
+        fail("\nUnable to unmount %s (errno %d)\n", argv[2], errno);
+    unmounted = 1;
+    for (i = 0; i < RACE_THREADS; i++)
+        pthread_join(tids[i], NULL);
+
+    if(race_errors > 0)
+        fail("\n%d system calls on device %d gave an unexpected result while it was being unmounted\n", race_errors, ids[1]);
+    if(device_id(argv[1]) != ids[0])
+        fail("\nDevice %d is not listed anymore after the unmount of device %d\n", ids[0], ids[1]);
+
+    // the other device is not affected
+    for (i = 1; i < NUM_MSGS; i++)
+        check_message(ids[0], blocks[0][i], msgs[0][i]);
+
+    print_color(GREEN);
+    printf("The system calls in progress completed, the following ones failed with ENODEV and device %d is still working.\n", ids[0]);
+    reset_color();
+
+    return 0;
+}
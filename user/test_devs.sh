@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Format two images, mount both of them and run test_devs on them: the test writes on both of them in group mode,
+# then unmounts the second one while it is being used. The module must be loaded and the script must be run with root privileges.
+#
+# Usage: ./test_devs.sh <formatter> <put_data_dev() NR> <get_data_dev() NR> <invalidate_data_dev() NR>
+#
+
+FORMATTER=$1
+NR_BLOCKS=1024
+
+if [ $# -lt 4 ]; then
+    echo "Usage: $0 <formatter> <put_data_dev() NR> <get_data_dev() NR> <invalidate_data_dev() NR>"
+    exit 1
+fi
+if [ ! -d /sys/module/the_bldms ] || [ "$(id -u)" -ne 0 ]; then
+    echo "The module is not loaded, or the script is not run with root privileges"
+    exit 1
+fi
+
+WORKDIR=$(mktemp -d /tmp/bldms_test_devs.XXXXXX)
+cleanup(){
+    umount $WORKDIR/a 2>/dev/null
+    umount $WORKDIR/b 2>/dev/null
+    rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+for d in a b; do
+    dd bs=4096 count=0 seek=$NR_BLOCKS of=$WORKDIR/image_$d 2>/dev/null
+    $FORMATTER $WORKDIR/image_$d > /dev/null || exit 1
+    mkdir $WORKDIR/$d
+    mount -o loop -t bldms_fs $WORKDIR/image_$d $WORKDIR/$d || exit 1
+done
+
+./test_devs $WORKDIR/a $WORKDIR/b $2 $3 $4
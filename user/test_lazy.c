@@ -0,0 +1,200 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file test_lazy.c
+ * @brief Testing program for the lazy mount of a BLDMS device, run by test_lazy.sh in three phases:
+ *      - fill: fill the device with messages;
+ *      - early: right after a lazy mount of the full device, read and invalidate the last blocks, which the background
+ *        scan has not reached yet, and put a message: it can only get one of the invalidated blocks;
+ *      - check: wait for the scan to complete, then check that all the blocks are valid, but the last two ones.
+ * It works on the device of id 0.
+ *
+ * @author Andrea Pepe
+ * @date April 22, 2023
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "include/pretty-print.h"
+
+#define BLOCK_SIZE (1<<12)
+#define METADATA_SIZE (sizeof(signed long long) + sizeof(uint16_t))
+#define MAX_MSG_SIZE (BLOCK_SIZE - METADATA_SIZE)
+#define FILL_MSG "Message written to fill the device before the lazy mount\n"
+#define EARLY_MSG "Message written while the device is being scanned\n"
+
+long put_data_nr = 0x0;
+long get_data_nr = 0x0;
+long invalidate_data_nr = 0x0;
+char *device_filepath;
+long num_blocks = 0;
+
+// declaration of macros for calling the system calls
+#define put_data(source, size) \
+            syscall(put_data_nr, source, size)
+
+#define get_data(offset, destination, size) \
+            syscall(get_data_nr, (long)(offset), destination, size)
+
+#define invalidate_data(offset) \
+            syscall(invalidate_data_nr, (long)(offset))
+
+
+/*
+* Print the reason of the failure of the test and exit with an error
+*/
+void fail(const char *fmt, ...){
+    va_list args;
+
+    print_color_bold(RED);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    reset_color();
+    exit(1);
+}
+
+
+/*
+* Check that the block "offset" keeps the message "msg"
+*/
+void check_message(long offset, const char *msg){
+    char buffer[BLOCK_SIZE];
+    long ret;
+
+    ret = get_data(offset, buffer, MAX_MSG_SIZE);
+    if(ret != (long)strlen(msg) + 1 || memcmp(buffer, msg, ret) != 0)
+        fail("\nBlock %ld does not keep the expected message (get_data() returned %ld, errno %d)\n", offset, ret, (ret < 0) ? errno : 0);
+}
+
+
+void fill(void){
+    long ret, n = 0;
+
+    while((ret = put_data(FILL_MSG, strlen(FILL_MSG) + 1)) >= 0)
+        n++;
+    if(errno != ENOMEM)
+        fail("\nput_data() called to fill the device failed with errno %d instead of ENOMEM\n", errno);
+    if(n != num_blocks)
+        fail("\nThe device must be empty: %ld messages have been written on its %ld blocks\n", n, num_blocks);
+
+    print_color(GREEN);
+    printf("The device has been filled with %ld messages.\n", n);
+    reset_color();
+}
+
+
+void early(void){
+    char buffer[BLOCK_SIZE];
+    long ret;
+
+    /*
+    * The background scan starts from the first block: the last blocks are scanned on demand. One of them is read
+    * before being invalidated, the other one is invalidated directly.
+    */
+    check_message(num_blocks - 1, FILL_MSG);
+    if(invalidate_data(num_blocks - 1) < 0)
+        fail("\ninvalidate_data() of block %ld failed with errno %d\n", num_blocks - 1, errno);
+    if(invalidate_data(num_blocks - 2) < 0)
+        fail("\ninvalidate_data() of block %ld failed with errno %d\n", num_blocks - 2, errno);
+    ret = get_data(num_blocks - 2, buffer, MAX_MSG_SIZE);
+    if(!(ret < 0 && errno == ENODATA))
+        fail("\nENODATA was expected for the invalidated block %ld, but get_data() returned %ld\n", num_blocks - 2, ret);
+    check_message(num_blocks - 3, FILL_MSG);
+
+    // the blocks not scanned yet are used: a new message can only be written in one of the invalidated blocks
+    ret = put_data(EARLY_MSG, strlen(EARLY_MSG) + 1);
+    if(ret >= 0){
+        if(ret != num_blocks - 1 && ret != num_blocks - 2)
+            fail("\nput_data() wrote block %ld, which keeps a valid message\n", ret);
+        check_message(ret, EARLY_MSG);
+        if(invalidate_data(ret) < 0)
+            fail("\ninvalidate_data() of block %ld failed with errno %d\n", ret, errno);
+    }else if(errno != ENOMEM){
+        fail("\nput_data() failed with errno %d\n", errno);
+    }
+
+    print_color(GREEN);
+    printf("The last blocks have been read and invalidated during the scan, and put_data() did not overwrite any valid block.\n");
+    reset_color();
+}
+
+
+void check(void){
+    char buffer[BLOCK_SIZE];
+    long i, ret;
+    int fd;
+
+    // reading the file waits for the whole index to be built
+    fd = open(device_filepath, O_RDONLY);
+    if(fd < 0 || read(fd, buffer, 1) < 0)
+        fail("\nUnable to read %s (errno %d)\n", device_filepath, errno);
+    close(fd);
+
+    for (i = 0; i < num_blocks - 2; i++)
+        check_message(i, FILL_MSG);
+    for (; i < num_blocks; i++){
+        ret = get_data(i, buffer, MAX_MSG_SIZE);
+        if(!(ret < 0 && errno == ENODATA))
+            fail("\nBlock %ld was invalidated, but get_data() returned %ld\n", i, ret);
+    }
+
+    print_color(GREEN);
+    printf("All the blocks are valid, but the two invalidated ones.\n");
+    reset_color();
+}
+
+
+int main(int argc, char **argv){
+    struct stat st;
+    int fd;
+
+    if(argc < 6){
+        printf("Usage:\n\t./%s <device file path> <put_data() NR> <get_data() NR> <invalidate_data() NR> <fill | early | check>\n\n", argv[0]);
+        exit(1);
+    }
+
+    // save device file location and system call numbers
+    device_filepath = argv[1];
+    put_data_nr = atol(argv[2]);
+    get_data_nr = atol(argv[3]);
+    invalidate_data_nr = atol(argv[4]);
+
+    fd = open(device_filepath, O_RDONLY);
+    if (fd < 0)
+        fail("Unable to call open on the specified path %s\n", device_filepath);
+    fstat(fd, &st);
+    num_blocks = st.st_size / BLOCK_SIZE;
+    close(fd);
+
+    if(strcmp(argv[5], "fill") == 0)
+        fill();
+    else if(strcmp(argv[5], "early") == 0)
+        early();
+    else if(strcmp(argv[5], "check") == 0)
+        check();
+    else
+        fail("Unknown phase %s\n", argv[5]);
+
+    return 0;
+}
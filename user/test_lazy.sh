@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Test of the lazy mount: an image is filled with messages and marked as not cleanly unmounted, then it is mounted
+# lazily and used right away by test_lazy, while the headers are still being scanned. Finally, it is unmounted in the
+# middle of another scan: the checkpoint must not be saved, and a following mount must find all the messages.
+# The module must be loaded, with no device mounted, and the script must be run with root privileges.
+#
+# Usage: ./test_lazy.sh <formatter> <put_data() NR> <get_data() NR> <invalidate_data() NR> [number of blocks]
+#
+
+FORMATTER=$1
+NRS="$2 $3 $4"
+NR_BLOCKS=${5:-262144}
+SCAN_DONE="background scan of .* completed"
+
+if [ $# -lt 4 ]; then
+    echo "Usage: $0 <formatter> <put_data() NR> <get_data() NR> <invalidate_data() NR> [number of blocks]"
+    exit 1
+fi
+if [ ! -d /sys/module/the_bldms ] || [ "$(id -u)" -ne 0 ]; then
+    echo "The module is not loaded, or the script is not run with root privileges"
+    exit 1
+fi
+if [ -s /sys/fs/bldms_fs/devices ]; then
+    echo "The test uses the device of id 0: unmount the other devices first"
+    exit 1
+fi
+
+WORKDIR=$(mktemp -d /tmp/bldms_test_lazy.XXXXXX)
+IMAGE=$WORKDIR/image
+FILE=$WORKDIR/mount/the_file
+cleanup(){
+    umount $WORKDIR/mount 2>/dev/null
+    rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+# clear the clean flag of the superblock (5th 64-bit field), as after a crash: the next mount scans the headers
+mark_unclean(){
+    dd if=/dev/zero of=$IMAGE bs=1 seek=32 count=8 conv=notrunc 2>/dev/null
+}
+
+scans_done(){
+    dmesg | grep -c "$SCAN_DONE"
+}
+
+dd bs=4096 count=0 seek=$NR_BLOCKS of=$IMAGE 2>/dev/null
+$FORMATTER $IMAGE > /dev/null || exit 1
+mkdir $WORKDIR/mount
+
+mount -o loop,durability=async -t bldms_fs $IMAGE $WORKDIR/mount || exit 1
+./test_lazy $FILE $NRS fill || exit 1
+umount $WORKDIR/mount
+mark_unclean
+sync
+echo 3 > /proc/sys/vm/drop_caches
+
+# the device is used as soon as the mount returns
+before=$(scans_done)
+mount -o loop,lazy -t bldms_fs $IMAGE $WORKDIR/mount || exit 1
+./test_lazy $FILE $NRS early || exit 1
+if [ $(scans_done) -ne $before ]; then
+    echo "WARNING: the scan completed before the end of the early phase: run the test with a bigger number of blocks"
+fi
+./test_lazy $FILE $NRS check || exit 1
+umount $WORKDIR/mount
+
+# unmount in the middle of a scan: the index is not complete, so the device must stay not cleanly unmounted
+mark_unclean
+sync
+echo 3 > /proc/sys/vm/drop_caches
+before=$(scans_done)
+mount -o loop,lazy -t bldms_fs $IMAGE $WORKDIR/mount || exit 1
+umount $WORKDIR/mount
+if [ $(scans_done) -ne $before ]; then
+    echo "WARNING: the scan completed before the unmount: run the test with a bigger number of blocks"
+elif [ $(od -An -tu8 -j32 -N8 $IMAGE) -ne 0 ]; then
+    echo "The device has been marked as cleanly unmounted, although its scan did not complete"
+    exit 1
+fi
+
+mount -o loop -t bldms_fs $IMAGE $WORKDIR/mount || exit 1
+./test_lazy $FILE $NRS check || exit 1
+echo "The device was left consistent by the unmount in the middle of the scan."
@@ -0,0 +1,246 @@
+/**
+ * Copyright (C) 2023 Andrea Pepe <pepe.andmj@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * @file test_multi.c
+ * @brief Testing program for the get_data_multi() system call of the BLDMS block device driver: the result of
+ * every block requested through get_data_multi() is compared with the one of get_data() on the same block.
+ * It needs at least 10 free blocks on the device of id 0.
+ *
+ * @author Andrea Pepe
+ * @date April 22, 2023
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "include/pretty-print.h"
+
+#define BLOCK_SIZE (1<<12)
+#define METADATA_SIZE (sizeof(signed long long) + sizeof(uint16_t))
+#define MAX_MSG_SIZE (BLOCK_SIZE - METADATA_SIZE)
+#define MAX_BATCH 64                    // maximum number of blocks of a get_data_multi() (BLDMS_MAX_BATCH)
+#define NUM_PUTS 10                     // messages written by the test
+#define INVALID_PUT 3                   // message invalidated before reading the blocks
+#define PARTIAL_SIZE 5                  // size of the buffer of the partial read
+#define POISON 0xA5                     // initial content of the buffers, to detect the bytes written
+
+long put_data_nr = 0x0;
+long get_data_nr = 0x0;
+long invalidate_data_nr = 0x0;
+long get_data_multi_nr = 0x0;
+char *device_filepath;
+size_t num_blocks = 0;
+
+// declaration of macros for calling the system calls
+#define put_data(source, size) \
+            syscall(put_data_nr, source, size)
+
+#define get_data(offset, destination, size) \
+            syscall(get_data_nr, (long)(offset), destination, size)
+
+#define invalidate_data(offset) \
+            syscall(invalidate_data_nr, (long)(offset))
+
+#define get_data_multi(dev, descs, n, results) \
+            syscall(get_data_multi_nr, dev, descs, n, results)
+
+// descriptor of a block of get_data_multi(), as defined by the module
+struct bldms_get_desc {
+    long offset;
+    char *destination;
+    size_t size;
+};
+
+long blocks[NUM_PUTS];
+struct bldms_get_desc descs[MAX_BATCH + 1];
+long results[MAX_BATCH + 1];
+char multi_bufs[MAX_BATCH + 1][BLOCK_SIZE];
+char single_buf[BLOCK_SIZE];
+
+
+/*
+* Print the reason of the failure of the test and exit with an error
+*/
+void fail(const char *fmt, ...){
+    va_list args;
+
+    print_color_bold(RED);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    reset_color();
+    exit(1);
+}
+
+
+/*
+* Set the i-th descriptor to read the block "offset" in its own buffer, filled with POISON
+*/
+void set_desc(int i, long offset, size_t size){
+    descs[i].offset = offset;
+    descs[i].destination = multi_bufs[i];
+    descs[i].size = size;
+    memset(multi_bufs[i], POISON, BLOCK_SIZE);
+}
+
+
+/*
+* Compare the result of each of the "n" blocks read by get_data_multi(), which returned "ret",
+* with the one of get_data() on the same block and with the same size
+*/
+void check_against_get_data(int n, long ret){
+    long expected, delivered = 0;
+    int i, j;
+
+    for (i = 0; i < n; i++){
+        memset(single_buf, POISON, BLOCK_SIZE);
+        expected = get_data(descs[i].offset, single_buf, descs[i].size);
+        if(expected < 0)
+            expected = -errno;
+
+        if(results[i] != expected)
+            fail("\nBlock %ld (entry %d): get_data_multi() gave %ld, get_data() gave %ld\n", descs[i].offset, i, results[i], expected);
+        if(expected < 0)
+            continue;
+        delivered++;
+
+        if(memcmp(multi_bufs[i], single_buf, expected) != 0)
+            fail("\nBlock %ld (entry %d): get_data_multi() and get_data() delivered different contents\n", descs[i].offset, i);
+        // nothing is written after the delivered bytes
+        for (j = expected; j < BLOCK_SIZE; j++){
+            if((unsigned char)multi_bufs[i][j] != POISON)
+                fail("\nBlock %ld (entry %d): get_data_multi() wrote byte %d, after the %ld delivered ones\n", descs[i].offset, i, j, expected);
+        }
+    }
+
+    if(ret != delivered)
+        fail("\nget_data_multi() returned %ld, but %ld blocks were delivered\n", ret, delivered);
+}
+
+
+int main(int argc, char **argv){
+    char msg[128];
+    struct stat st;
+    long ret;
+    int i, j, n, fd;
+
+    if(argc < 6){
+        printf("Usage:\n\t./%s <device file path> <put_data() NR> <get_data() NR> <invalidate_data() NR> <get_data_multi() NR>\n\n", argv[0]);
+        exit(1);
+    }
+
+    print_color_bold(YELLOW);
+    printf("Initializing ...\n");
+    reset_color();
+
+    // save device file location and system call numbers
+    device_filepath = argv[1];
+    put_data_nr = atol(argv[2]);
+    get_data_nr = atol(argv[3]);
+    invalidate_data_nr = atol(argv[4]);
+    get_data_multi_nr = atol(argv[5]);
+
+    fd = open(device_filepath, O_RDONLY);
+    if (fd < 0)
+        fail("Unable to call open on the specified path %s\n", device_filepath);
+    fstat(fd, &st);
+    num_blocks = st.st_size / BLOCK_SIZE;
+    close(fd);
+
+    // every message is different, so that a block delivered in the wrong buffer is detected
+    for (i = 0; i < NUM_PUTS; i++){
+        snprintf(msg, sizeof(msg), "Message %d of the get_data_multi() test\n", i);
+        blocks[i] = put_data(msg, strlen(msg) + 1);
+        if(blocks[i] < 0)
+            fail("put_data() failed with errno %d: the test needs at least %d free blocks\n", errno, NUM_PUTS);
+    }
+    if(invalidate_data(blocks[INVALID_PUT]) < 0)
+        fail("invalidate_data() failed with errno %d\n", errno);
+
+    print_color_bold(YELLOW);
+    printf("%d messages written and one of them invalidated. Reading them through get_data_multi() ...\n", NUM_PUTS);
+    reset_color();
+
+    /*
+    * The blocks are requested in the reverse order of their writing, so that the module reorders them by position:
+    * each result must still be delivered in the entry of the request that asked for it.
+    * An invalid block, two blocks that do not exist, a partial read and a block requested twice are added.
+    */
+    n = 0;
+    for (i = NUM_PUTS - 1; i >= 0; i--)
+        set_desc(n++, blocks[i], MAX_MSG_SIZE);
+    set_desc(n++, num_blocks + 10, MAX_MSG_SIZE);
+    set_desc(n++, -1, MAX_MSG_SIZE);
+    set_desc(n++, blocks[0], PARTIAL_SIZE);
+    set_desc(n++, blocks[NUM_PUTS - 1], MAX_MSG_SIZE);
+
+    ret = get_data_multi(0, descs, n, results);
+    if(ret < 0)
+        fail("\nget_data_multi() unexpectedly failed with errno %d\n", errno);
+    check_against_get_data(n, ret);
+
+    // the expected errors are checked explicitly too, in case get_data() is wrong as well
+    if(results[NUM_PUTS - 1 - INVALID_PUT] != -ENODATA)
+        fail("\nENODATA was expected for the invalidated block, but %ld was returned\n", results[NUM_PUTS - 1 - INVALID_PUT]);
+    if(results[NUM_PUTS] != -E2BIG || results[NUM_PUTS + 1] != -E2BIG)
+        fail("\nE2BIG was expected for the blocks that do not exist, but %ld and %ld were returned\n", results[NUM_PUTS], results[NUM_PUTS + 1]);
+    if(results[NUM_PUTS + 2] != PARTIAL_SIZE)
+        fail("\n%d bytes were expected for the partial read, but %ld were returned\n", PARTIAL_SIZE, results[NUM_PUTS + 2]);
+
+    print_color(GREEN);
+    printf("get_data_multi() delivered %ld blocks in request order, with the same results of get_data().\n", ret);
+    reset_color();
+
+    print_color_bold(YELLOW);
+    printf("\nChecking the limits on the number of blocks ...\n");
+    reset_color();
+
+    // a full batch of valid blocks, each one requested several times
+    for (i = 0; i < MAX_BATCH; i++){
+        j = i % (NUM_PUTS - 1);
+        set_desc(i, blocks[(j < INVALID_PUT) ? j : j + 1], MAX_MSG_SIZE);
+    }
+    ret = get_data_multi(0, descs, MAX_BATCH, results);
+    if(ret != MAX_BATCH)
+        fail("\nget_data_multi() of %d valid blocks returned %ld (errno %d)\n", MAX_BATCH, ret, (ret < 0) ? errno : 0);
+    check_against_get_data(MAX_BATCH, ret);
+
+    set_desc(MAX_BATCH, blocks[0], MAX_MSG_SIZE);
+    ret = get_data_multi(0, descs, MAX_BATCH + 1, results);
+    if(!(ret < 0 && errno == EINVAL))
+        fail("\nEINVAL was expected for %d blocks, but get_data_multi() returned %ld (errno %d)\n", MAX_BATCH + 1, ret, errno);
+    ret = get_data_multi(0, descs, 0, results);
+    if(!(ret < 0 && errno == EINVAL))
+        fail("\nEINVAL was expected for 0 blocks, but get_data_multi() returned %ld (errno %d)\n", ret, errno);
+
+    print_color(GREEN);
+    printf("get_data_multi() read %d blocks at once and set errno to EINVAL for 0 and %d blocks, as expected.\n", MAX_BATCH, MAX_BATCH + 1);
+    reset_color();
+
+    // the device is left as it was
+    for (i = 0; i < NUM_PUTS; i++){
+        if(i != INVALID_PUT && invalidate_data(blocks[i]) < 0)
+            fail("\ninvalidate_data() of block %ld failed with errno %d\n", blocks[i], errno);
+    }
+
+    return 0;
+}
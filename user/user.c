@@ -48,10 +48,10 @@ char *device_filepath;
             syscall(put_data_nr, source, size)
 
 #define get_data(offset, destination, size) \
-            syscall(get_data_nr, offset, destination, size)
+            syscall(get_data_nr, (long)(offset), destination, size)
 
 #define invalidate_data(offset) \
-            syscall(invalidate_data_nr, offset)
+            syscall(invalidate_data_nr, (long)(offset))
 
 
 
@@ -68,10 +68,10 @@ int total_errors = 0;                           // global variable to check for
             syscall(put_data_nr, source, size)
 
 #define get_data(offset, destination, size) \
-            syscall(get_data_nr, offset, destination, size)
+            syscall(get_data_nr, (long)(offset), destination, size)
 
 #define invalidate_data(offset) \
-            syscall(invalidate_data_nr, offset)
+            syscall(invalidate_data_nr, (long)(offset))
 
 
 /*